@@ -0,0 +1,25 @@
+/* Generated by tools/encode_animation.py from animation.csv, do not edit */
+/* 26 frames, 236 bytes (1430 uncompressed, 6.1:1) */
+
+static const uint8_t animation_snowflake[] PROGMEM = {
+	0x14, 0x51, 0x00, 0x00, 0x00, 0x00, 0x04, 0x02, 0x80, 0x10, 0x30, 0x60,
+	0x00, 0x04, 0x01, 0x41, 0x20, 0x60, 0xc0, 0x00, 0x06, 0x80, 0x80, 0xc0,
+	0xff, 0x00, 0x04, 0x05, 0x80, 0x10, 0x30, 0x60, 0x00, 0x04, 0x03, 0x80,
+	0x20, 0x60, 0xc0, 0x01, 0x80, 0x20, 0x60, 0xc0, 0x00, 0x06, 0x04, 0x80,
+	0x80, 0xc0, 0xff, 0x00, 0x04, 0x08, 0x80, 0x10, 0x30, 0x60, 0x00, 0x04,
+	0x06, 0x80, 0x20, 0x60, 0xc0, 0x01, 0x80, 0x20, 0x60, 0xc0, 0x00, 0x06,
+	0x07, 0x80, 0x80, 0xc0, 0xff, 0x00, 0x04, 0x0b, 0x80, 0x10, 0x30, 0x60,
+	0x00, 0x04, 0x09, 0x80, 0x20, 0x60, 0xc0, 0x01, 0x80, 0x20, 0x60, 0xc0,
+	0x00, 0x06, 0x0a, 0x80, 0x80, 0xc0, 0xff, 0x00, 0x04, 0x0e, 0x80, 0x10,
+	0x30, 0x60, 0x00, 0x04, 0x0c, 0x80, 0x20, 0x60, 0xc0, 0x01, 0x80, 0x20,
+	0x60, 0xc0, 0x00, 0x06, 0x0d, 0x80, 0x80, 0xc0, 0xff, 0x00, 0x04, 0x11,
+	0x80, 0x10, 0x30, 0x60, 0x00, 0x04, 0x0f, 0x80, 0x20, 0x60, 0xc0, 0x01,
+	0x80, 0x20, 0x60, 0xc0, 0x00, 0x06, 0x10, 0x80, 0x80, 0xc0, 0xff, 0x00,
+	0x06, 0x02, 0x80, 0xff, 0xff, 0xff, 0x02, 0x80, 0xff, 0xff, 0xff, 0x02,
+	0x80, 0xff, 0xff, 0xff, 0x02, 0x80, 0xff, 0xff, 0xff, 0x02, 0x80, 0xff,
+	0xff, 0xff, 0x02, 0x80, 0xff, 0xff, 0xff, 0x00, 0x0a, 0x51, 0xff, 0xff,
+	0xff, 0x00, 0x06, 0x51, 0x60, 0x60, 0x60, 0x00, 0x06, 0x51, 0x20, 0x20,
+	0x20, 0x00, 0x06, 0x51, 0x08, 0x08, 0x08, 0x00, 0x08, 0x04, 0x80, 0x80,
+	0xc0, 0xff, 0x05, 0x80, 0x80, 0xc0, 0xff, 0x05, 0x80, 0x80, 0xc0, 0xff,
+	0x00, 0x28, 0x51, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "audio.h"
+
+#if AUDIO_ENABLE
+
+/********************************************************************************
+ * Band energy detection
+ *
+ * Each band is a Goertzel filter, a resonator that is run over a block of
+ * AUDIO_BLOCK samples:
+ *
+ *	s = x + c * s1 - s2,	s2 = s1, s1 = s
+ *
+ * with c = 2 cos(2 pi f / fs). The ATtiny has no multiplier, so the bands sit
+ * where c is a sum of shifts:
+ *
+ *	bass	fs / 24		c = 1.932, used 2 - 1/16
+ *	mid	fs / 6		c = 1
+ *	high	fs / 3		c = -1
+ *
+ * At the end of a block the magnitude is |s1 - s2 cos| + j s2 sin, again with
+ * shifts for sin and cos, and approximated as max + min / 2 of the two parts.
+ *
+ * Everything runs in the ADC interrupt, so only between frames: send_frame
+ * keeps interrupts off for about 0.6ms per 18 LEDs, and the conversions that
+ * finish in that time are lost. With 16ms blocks that smears the bands a
+ * little, which a level meter does not notice.
+ *
+ * Cycle budget, at 16MHz: the ADC interrupt comes every 1664 cycles (104us)
+ * and must be done well within that. Adding up a conversion takes about 40
+ * cycles, a filter step for all bands about 150 (every fourth conversion) and
+ * the end of a block about 400 (every 192nd), or about 5% of the CPU in total.
+ * The share is the same at any clock, as the ADC is clocked from F_CPU too. Build with -DAUDIO_PROFILE to measure the
+ * worst case on the target in audio_max_cycles (Timer1 at CK/8, the same as
+ * WS2812_SHADER_PROFILE).
+ ********************************************************************************/
+
+volatile uint8_t audio_levels[AUDIO_BANDS];
+
+#ifdef AUDIO_PROFILE
+volatile uint16_t audio_max_cycles = 0;
+#endif
+
+static uint16_t decimate_sum;
+static uint8_t decimate_count;
+static uint8_t block_count;
+static uint16_t dc_level;					// Input bias, 8.8 fixed point
+static int16_t s1[AUDIO_BANDS];
+static int16_t s2[AUDIO_BANDS];
+
+/************************************************************
+ * magnitude: approximate length of a complex number
+ *	Params:
+ *		int16_t		real part
+ *		int16_t		imaginary part
+ *	Returns:
+ *		uint8_t		length / 16, saturated
+ ************************************************************/
+
+static uint8_t magnitude(int16_t re, int16_t im)
+{
+
+	uint16_t a = abs(re);
+	uint16_t b = abs(im);
+	uint16_t length;
+
+	if (a > b) {
+		length = a + (b >> 1);
+	} else {
+		length = b + (a >> 1);
+	}
+
+	length >>= 4;
+
+	return (length > 0xff) ? 0xff : length;
+
+}
+
+/************************************************************
+ * update_level: new level of a band at the end of a block
+ *	Params:
+ *		uint8_t		band
+ *		uint8_t		level of this block
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static void update_level(uint8_t band, uint8_t level)
+{
+
+	uint8_t old = audio_levels[band];
+
+	if (level >= old) {
+		audio_levels[band] = level;
+	} else {
+		audio_levels[band] = old - ((old - level + 7) >> 3);
+	}
+
+}
+
+/************************************************************
+ * audio_sample: filter a conversion
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void audio_sample(void)
+{
+
+	int16_t x;
+	int16_t s;
+	uint8_t band;
+
+#ifdef AUDIO_PROFILE
+	uint8_t start = TCNT1;
+#endif
+
+	decimate_sum += ADCH;
+
+	if (++decimate_count < AUDIO_DECIMATE) {
+		return;
+	}
+
+	// Sample without the input bias, which is tracked over about 256 samples
+	x = (int16_t) (decimate_sum / AUDIO_DECIMATE) - (dc_level >> 8);
+	dc_level += x;
+	decimate_sum = 0;
+	decimate_count = 0;
+
+	s = x + (s1[AUDIO_BAND_BASS] << 1) - (s1[AUDIO_BAND_BASS] >> 4) - s2[AUDIO_BAND_BASS];
+	s2[AUDIO_BAND_BASS] = s1[AUDIO_BAND_BASS];
+	s1[AUDIO_BAND_BASS] = s;
+
+	s = x + s1[AUDIO_BAND_MID] - s2[AUDIO_BAND_MID];
+	s2[AUDIO_BAND_MID] = s1[AUDIO_BAND_MID];
+	s1[AUDIO_BAND_MID] = s;
+
+	s = x - s1[AUDIO_BAND_HIGH] - s2[AUDIO_BAND_HIGH];
+	s2[AUDIO_BAND_HIGH] = s1[AUDIO_BAND_HIGH];
+	s1[AUDIO_BAND_HIGH] = s;
+
+	if (++block_count == AUDIO_BLOCK) {
+
+		// cos 0.969, sin 0.248
+		update_level(AUDIO_BAND_BASS, magnitude(
+			s1[AUDIO_BAND_BASS] - s2[AUDIO_BAND_BASS] + (s2[AUDIO_BAND_BASS] >> 5),
+			s2[AUDIO_BAND_BASS] >> 2));
+
+		// cos 0.5, sin 0.866
+		update_level(AUDIO_BAND_MID, magnitude(
+			s1[AUDIO_BAND_MID] - (s2[AUDIO_BAND_MID] >> 1),
+			s2[AUDIO_BAND_MID] - (s2[AUDIO_BAND_MID] >> 3)));
+
+		// cos -0.5, sin 0.866
+		update_level(AUDIO_BAND_HIGH, magnitude(
+			s1[AUDIO_BAND_HIGH] + (s2[AUDIO_BAND_HIGH] >> 1),
+			s2[AUDIO_BAND_HIGH] - (s2[AUDIO_BAND_HIGH] >> 3)));
+
+		for (band = 0; band < AUDIO_BANDS; band++) {
+			s1[band] = 0;
+			s2[band] = 0;
+		}
+
+		block_count = 0;
+
+	}
+
+#ifdef AUDIO_PROFILE
+	uint16_t cycles = (uint8_t) (TCNT1 - start) * 8;
+	if (cycles > audio_max_cycles) {
+		audio_max_cycles = cycles;
+	}
+#endif
+
+}
+
+/************************************************************
+ * audio_start: start sampling
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * The ADC runs free with VCC as reference and the result left
+ * adjusted, so only ADCH needs to be read.
+ ************************************************************/
+
+extern void audio_start(void)
+{
+
+	uint8_t band;
+
+	// Free running is audio, anything else is a sensor measurement to cut short
+	if (ADCSRA & (1 << ADATE)) {
+		return;
+	}
+
+#ifdef AUDIO_PROFILE
+	TCCR1 = (1 << CS12);	// CK/8
+#endif
+
+	decimate_sum = 0;
+	decimate_count = 0;
+	block_count = 0;
+	dc_level = 128 << 8;
+
+	for (band = 0; band < AUDIO_BANDS; band++) {
+		s1[band] = 0;
+		s2[band] = 0;
+		audio_levels[band] = 0;
+	}
+
+	// Digital input off on the audio pin
+#if AUDIO_CHANNEL == 3
+	DIDR0 |= (1 << ADC3D);
+	PORTB &= ~(1 << PB3);
+#else
+	DIDR0 |= (1 << ADC2D);
+	PORTB &= ~(1 << PB4);
+#endif
+
+	ADMUX = (1 << ADLAR) | AUDIO_CHANNEL;
+	ADCSRB = 0;		// Free running
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) |
+		(1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+
+}
+
+/************************************************************
+ * audio_stop: stop sampling and power the ADC down
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void audio_stop(void)
+{
+
+	ADCSRA = 0;
+
+}
+
+#endif
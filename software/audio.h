@@ -0,0 +1,118 @@
+/************************************************
+ * audio.h
+ *
+ * Audio band energy detector
+ ************************************************/
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * The audio input is a microphone amplifier (or line level
+ * signal) biased at half the supply, on ADC3 (PB3) or ADC2
+ * (PB4), so not with the crystal. Build with -DAUDIO_ENABLE=1
+ * to get the audio patterns.
+ ************************************************************/
+
+#ifndef AUDIO_ENABLE
+#define AUDIO_ENABLE	0
+#endif
+
+/* ADC channel: 3 is PB3, 2 is PB4 */
+#ifndef AUDIO_CHANNEL
+#define AUDIO_CHANNEL	3
+#endif
+
+#if AUDIO_CHANNEL != 2 && AUDIO_CHANNEL != 3
+#error "AUDIO_CHANNEL must be 2 (PB4) or 3 (PB3)"
+#endif
+
+/* PB3 and PB4 are XTAL1 and XTAL2 of the 20MHz crystal with the
+ * default fuses (FUSES in the Makefile, lfuse 0xee), and the
+ * other pins are taken, so the audio input needs the clock from
+ * the PLL: FUSES = $(FUSES_PLL), CLOCK = 16000000 and
+ * WS2812_OUTPUT_TIMER1, see the Makefile. The Makefile sets
+ * CLOCK_INTERNAL from the lfuse it flashes. */
+#ifndef CLOCK_INTERNAL
+#define CLOCK_INTERNAL	0
+#endif
+
+#if AUDIO_ENABLE && !CLOCK_INTERNAL
+#error "AUDIO_ENABLE needs PB3 or PB4, which the crystal uses: build for the PLL clock (FUSES_PLL in the Makefile)"
+#endif
+
+/* The ADC runs free at F_CPU / 128 / 13 (9.6kHz at 16MHz, the
+ * PLL clock the audio input needs), and AUDIO_DECIMATE
+ * conversions are averaged into one sample */
+#define AUDIO_DECIMATE		4
+#define AUDIO_SAMPLE_RATE	(F_CPU / 128 / 13 / AUDIO_DECIMATE)
+
+/* Samples per Goertzel block. Must be a multiple of 24, so that
+ * every band is a whole number of periods */
+#define AUDIO_BLOCK			48
+#define AUDIO_BLOCK_MS		(AUDIO_BLOCK * 1000UL / AUDIO_SAMPLE_RATE)
+
+/* Bands, at 16MHz (fs is 2404Hz, a block 20ms) */
+enum {
+	AUDIO_BAND_BASS,	// fs / 24, 100Hz
+	AUDIO_BAND_MID,		// fs / 6, 400Hz
+	AUDIO_BAND_HIGH,	// fs / 3, 800Hz
+	AUDIO_BANDS,
+};
+
+/* Public interface */
+
+/************************************************************
+ * audio_levels: energy per band
+ *
+ * 0 - 255, updated every AUDIO_BLOCK samples. A full scale sine
+ * in the middle of a band gives about 192. Levels rise at once
+ * and decay over a few blocks.
+ ************************************************************/
+
+extern volatile uint8_t audio_levels[AUDIO_BANDS];
+
+/************************************************************
+ * audio_start: start sampling
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * Does nothing if sampling is already running.
+ ************************************************************/
+
+extern void audio_start(void);
+
+/************************************************************
+ * audio_stop: stop sampling and power the ADC down
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void audio_stop(void);
+
+/************************************************************
+ * audio_sample: filter a conversion
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * Called from the ADC interrupt while sampling runs.
+ ************************************************************/
+
+extern void audio_sample(void);
+
+#ifdef AUDIO_PROFILE
+/* Longest ADC interrupt seen so far, in cycles (8 cycle steps) */
+extern volatile uint16_t audio_max_cycles;
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+/************************************************
+ * button.h
+ *
+ * Button gesture detector
+ ************************************************/
+
+#ifndef BUTTON_H
+#define BUTTON_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * The detector is fed one sample of the button every time
+ * slice (10ms in snowflake.c). It is plain C on integers, so
+ * tests/button_test.c can replay bounce traces through it on
+ * the host.
+ ************************************************************/
+
+#define DEBOUNCE_COUNT_SHORT	3	// Slices a button must be down for a short push
+#define DEBOUNCE_COUNT_RELEASE	2	// Slices a button must be up before a push has ended
+#define DEBOUNCE_COUNT_LONG		100	// Slices after which a push is a long push
+
+enum {
+	BUTTON_EVENT_NONE,
+	BUTTON_EVENT_SHORT,		// Pushed and let go
+	BUTTON_EVENT_LONG,		// Held for DEBOUNCE_COUNT_LONG slices, still down
+};
+
+/* Public interface */
+
+/************************************************************
+ * struct button: state of the detector
+ *
+ * down_count counts the slices the button was seen down, and
+ * is 0 while no push is going on. release_count counts the
+ * slices in a row it was seen up.
+ ************************************************************/
+
+struct button {
+	uint8_t down_count;
+	uint8_t release_count;
+};
+
+/************************************************************
+ * button_press: start a push
+ *	Params:
+ *		struct button *	detector
+ *	Returns:
+ *		void
+ *
+ * Call on the first edge of a push, while down_count is 0.
+ ************************************************************/
+
+static inline void button_press(volatile struct button *button)
+{
+
+	button->down_count = 1;
+	button->release_count = 0;
+
+}
+
+/************************************************************
+ * button_slice: take the sample of a time slice
+ *	Params:
+ *		struct button *	detector
+ *		uint8_t			non-zero if the button is down
+ *	Returns:
+ *		uint8_t			BUTTON_EVENT_*
+ *
+ * A push has ended after DEBOUNCE_COUNT_RELEASE slices up, and
+ * it was a short push if the button was down for at least
+ * DEBOUNCE_COUNT_SHORT slices. Anything shorter is noise. So a
+ * short push is reported 10 to 20ms after the button is let
+ * go, plus any bounce. A long push is reported while the
+ * button is still held. Either way down_count is back to 0
+ * afterwards.
+ ************************************************************/
+
+static inline uint8_t button_slice(volatile struct button *button, uint8_t down)
+{
+
+	uint8_t event = BUTTON_EVENT_NONE;
+
+	if (down) {
+
+		button->release_count = 0;
+
+		if (++button->down_count == DEBOUNCE_COUNT_LONG) {
+			button->down_count = 0;
+			event = BUTTON_EVENT_LONG;
+		}
+
+	} else if (++button->release_count == DEBOUNCE_COUNT_RELEASE) {
+
+		if (button->down_count >= DEBOUNCE_COUNT_SHORT) {
+			event = BUTTON_EVENT_SHORT;
+		}
+		button->down_count = 0;
+
+	}
+
+	if (button->down_count == 0) {
+		button->release_count = 0;
+	}
+
+	return event;
+
+}
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef __AVR__
+#include <avr/io.h>
+#endif
+#include "ws2812.h"
+#include "colour.h"
+
+/********************************************************************************
+ * Colour kernels
+ *
+ * The colour functions work a channel at a time, named by member, so they are
+ * right for every WS2812_ORDER. intensity_halve walks the LED data as bytes
+ * instead: all channels get the same treatment, and a pointer running over a
+ * flat buffer is cheaper on the AVR than a displacement per member.
+ *
+ * Cycles per RGB LED, counted by hand from the code avr-gcc makes at -Os,
+ * against the C versions they replaced in snowflake.c:
+ *
+ *	scale_colour		120		was 290		three scale8 of 34, not 90
+ *	blend_colour		140		was 310		three lerp8
+ *	add_colour			21		was 30		qadd8 is 3 cycles
+ *	intensity_halve		30		was 35		all in the load and store
+ *	nscale_buffer		125		  - 	scale_colour on each LED: about 150
+ *
+ * Only the multiplies gain much: on an 8 bit core a byte operation is one
+ * cycle whichever way it is written. nscale_buffer saves the call and the
+ * struct passed in registers per LED, not any arithmetic.
+ *
+ * These are counts, not measurements: there is no target to run on here.
+ * Build with -DCOLOUR_PROFILE to measure intensity_halve and nscale_buffer on
+ * the target, the latter against the per channel loop. Timer1 then runs at
+ * CK/16, so up to about 4000 cycles fit in its 8 bits: enough for 18 RGBW
+ * LEDs halved, or 6 scaled a channel at a time (COLOUR_PROFILE_LEDS), but not
+ * 18 RGBW LEDs scaled, which reads short. It needs the registers, so it only
+ * builds for the AVR.
+ ********************************************************************************/
+
+#ifdef COLOUR_PROFILE
+#ifndef __AVR__
+#error "COLOUR_PROFILE times with Timer1, so it only builds for the AVR"
+#endif
+
+volatile uint16_t colour_halve_cycles = 0;
+volatile uint16_t colour_nscale_cycles = 0;
+volatile uint16_t colour_nscale_channel_cycles = 0;
+
+#define PROFILE_START()			TCCR1 = (1 << CS12) | (1 << CS10); uint8_t start = TCNT1
+#define PROFILE_END(result)		result = (uint8_t) (TCNT1 - start) * 16 / num_leds
+#else
+#define PROFILE_START()
+#define PROFILE_END(result)
+#endif
+
+extern struct RGB blend_colour(struct RGB from, struct RGB to, uint8_t amount)
+{
+
+	return (struct RGB){
+		.red = lerp8(from.red, to.red, amount),
+		.green = lerp8(from.green, to.green, amount),
+		.blue = lerp8(from.blue, to.blue, amount),
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		.white = lerp8(from.white, to.white, amount),
+#endif
+	};
+
+}
+
+extern struct RGB scale_colour(struct RGB colour, uint16_t scale)
+{
+
+	if (scale >= 256) {
+		return colour;
+	}
+
+	return (struct RGB){
+		.red = scale8(colour.red, scale),
+		.green = scale8(colour.green, scale),
+		.blue = scale8(colour.blue, scale),
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		.white = scale8(colour.white, scale),
+#endif
+	};
+
+}
+
+extern struct RGB multiply_colour(struct RGB colour, struct RGB gain)
+{
+
+	return (struct RGB){
+		.red = scale8(colour.red, gain.red),
+		.green = scale8(colour.green, gain.green),
+		.blue = scale8(colour.blue, gain.blue),
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		.white = scale8(colour.white, gain.white),
+#endif
+	};
+
+}
+
+extern void add_colour(struct RGB *led, struct RGB colour)
+{
+
+	led->red = qadd8(led->red, colour.red);
+	led->green = qadd8(led->green, colour.green);
+	led->blue = qadd8(led->blue, colour.blue);
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	led->white = qadd8(led->white, colour.white);
+#endif
+
+}
+
+extern void subtract_colour(struct RGB *led, struct RGB colour)
+{
+
+	led->red = qsub8(led->red, colour.red);
+	led->green = qsub8(led->green, colour.green);
+	led->blue = qsub8(led->blue, colour.blue);
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	led->white = qsub8(led->white, colour.white);
+#endif
+
+}
+
+extern uint8_t intensity_halve(struct RGB *data, uint8_t num_leds)
+{
+
+	uint8_t *byte = (uint8_t *) data;
+	uint8_t *end = byte + num_leds * sizeof(struct RGB);
+	uint8_t lit = 0;
+
+	PROFILE_START();
+
+	while (byte < end) {
+		uint8_t value = *byte >> 1;
+		*byte++ = value;
+		lit |= value;
+	}
+
+	PROFILE_END(colour_halve_cycles);
+
+	return lit;
+
+}
+
+extern uint8_t nscale_buffer(struct RGB *data, uint8_t num_leds, uint8_t scale)
+{
+
+	uint8_t *byte = (uint8_t *) data;
+	uint8_t *end = byte + num_leds * sizeof(struct RGB);
+	uint8_t lit = 0;
+
+#ifdef COLOUR_PROFILE
+	{
+		struct RGB copy[COLOUR_PROFILE_LEDS];
+		uint8_t leds = num_leds < COLOUR_PROFILE_LEDS ? num_leds : COLOUR_PROFILE_LEDS;
+		uint8_t i;
+
+		for (i = 0; i < leds; i++) {
+			copy[i] = data[i];
+		}
+
+		{
+			PROFILE_START();
+			for (i = 0; i < leds; i++) {
+				copy[i] = scale_colour(copy[i], scale);
+			}
+			if (leds) {
+				colour_nscale_channel_cycles = (uint8_t) (TCNT1 - start) * 16 / leds;
+			}
+		}
+	}
+#endif
+
+	PROFILE_START();
+
+	while (byte < end) {
+		uint8_t value = scale8(*byte, scale);
+		*byte++ = value;
+		lit |= value;
+	}
+
+	PROFILE_END(colour_nscale_cycles);
+
+	return lit;
+
+}
@@ -0,0 +1,260 @@
+/************************************************
+ * colour.h
+ *
+ * Colour arithmetic for LED data
+ ************************************************/
+
+#ifndef COLOUR_H
+#define COLOUR_H
+
+#include <stdint.h>
+#include "ws2812.h"
+
+/************************************************************
+ * Build time configuration
+ *
+ * The ATtiny85 has no hardware multiplier, so the kernels that
+ * multiply are written in AVR assembler. Everywhere else (a
+ * host build of the patterns) the same functions are plain C.
+ * Build with -DCOLOUR_PROFILE to measure intensity_halve and
+ * nscale_buffer on the target (see colour_profile below).
+ ************************************************************/
+
+/* Public interface */
+
+/************************************************************
+ * scale8: scale a value by a fraction
+ *	Params:
+ *		uint8_t value
+ *		uint8_t scale		Fraction, in 256ths
+ *	Returns:
+ *		uint8_t				value * scale / 256, rounded down
+ *
+ * Shift and add, fully unrolled: 34 cycles whatever the
+ * arguments, where the C loop it replaces took about 90.
+ * The scale is shifted out at the bottom while the product
+ * is shifted in at the top, so it is an exact 8 x 8 bit
+ * multiply of which only the high byte is kept.
+ ************************************************************/
+
+static inline uint8_t scale8(uint8_t value, uint8_t scale)
+{
+#ifdef __AVR__
+
+	uint8_t result;
+
+	__asm__ (
+		"clr	%0\n\t"
+		"lsr	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		"brcc	.+2\n\t"	"add	%0, %2\n\t"	"ror	%0\n\t"	"ror	%1\n\t"
+		: "=&r" (result), "+r" (scale)
+		: "r" (value)
+	);
+
+	return result;
+
+#else
+
+	return ((uint16_t) value * scale) >> 8;
+
+#endif
+}
+
+/************************************************************
+ * lerp8: a value between two others
+ *	Params:
+ *		uint8_t from
+ *		uint8_t to
+ *		uint8_t amount		How far towards to, in 256ths
+ *	Returns:
+ *		uint8_t				from + (to - from) * amount / 256
+ ************************************************************/
+
+static inline uint8_t lerp8(uint8_t from, uint8_t to, uint8_t amount)
+{
+
+	if (to >= from) {
+		return from + scale8(to - from, amount);
+	}
+
+	return from - scale8(from - to, amount);
+
+}
+
+/************************************************************
+ * qadd8: add, saturating at 255
+ * qsub8: subtract, stopping at 0
+ *	Params:
+ *		uint8_t a
+ *		uint8_t b
+ *	Returns:
+ *		uint8_t				a + b or a - b
+ *
+ * Three cycles each: the carry of the add or subtract decides
+ * whether the result is replaced.
+ ************************************************************/
+
+static inline uint8_t qadd8(uint8_t a, uint8_t b)
+{
+#ifdef __AVR__
+
+	__asm__ (
+		"add	%0, %1\n\t"
+		"brcc	.+2\n\t"
+		"sbc	%0, %0\n\t"		// Carry set: 0 - 1 = 0xff
+		: "+r" (a)
+		: "r" (b)
+	);
+
+	return a;
+
+#else
+
+	return (a > (uint8_t) ~b) ? 0xff : a + b;
+
+#endif
+}
+
+static inline uint8_t qsub8(uint8_t a, uint8_t b)
+{
+#ifdef __AVR__
+
+	__asm__ (
+		"sub	%0, %1\n\t"
+		"brcc	.+2\n\t"
+		"clr	%0\n\t"
+		: "+r" (a)
+		: "r" (b)
+	);
+
+	return a;
+
+#else
+
+	return (a < b) ? 0 : a - b;
+
+#endif
+}
+
+/************************************************************
+ * scale_colour: dim a colour
+ *	Params:
+ *		struct RGB colour
+ *		uint16_t scale		Fraction, in 256ths: 256 is all of it
+ *	Returns:
+ *		struct RGB			the dimmed colour
+ ************************************************************/
+
+extern struct RGB scale_colour(struct RGB, uint16_t);
+
+/************************************************************
+ * blend_colour: mix two colours
+ *	Params:
+ *		struct RGB from
+ *		struct RGB to
+ *		uint8_t amount		How much of to, in 256ths
+ *	Returns:
+ *		struct RGB			the mix
+ ************************************************************/
+
+extern struct RGB blend_colour(struct RGB, struct RGB, uint8_t);
+
+/************************************************************
+ * multiply_colour: scale each channel of a colour by the same
+ * channel of another
+ *	Params:
+ *		struct RGB colour
+ *		struct RGB gain		Fraction per channel, in 256ths
+ *	Returns:
+ *		struct RGB			the scaled colour
+ *
+ * A grey gain dims, a coloured one tints.
+ ************************************************************/
+
+extern struct RGB multiply_colour(struct RGB, struct RGB);
+
+/************************************************************
+ * add_colour: add a colour to an LED, saturating
+ * subtract_colour: take it off again, stopping at 0
+ *	Params:
+ *		struct RGB *		LED to change
+ *		struct RGB			colour to add or subtract
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void add_colour(struct RGB *, struct RGB);
+extern void subtract_colour(struct RGB *, struct RGB);
+
+/************************************************************
+ * intensity_halve: fade a run of LEDs towards black
+ *	Params:
+ *		struct RGB *		LED data
+ *		uint8_t				number of LEDs
+ *	Returns:
+ *		uint8_t				non-zero while any LED is still lit
+ *
+ * Halves every channel. Call it once a step to fade out.
+ ************************************************************/
+
+extern uint8_t intensity_halve(struct RGB *, uint8_t);
+
+/************************************************************
+ * nscale_buffer: dim a run of LEDs in place
+ *	Params:
+ *		struct RGB *		LED data
+ *		uint8_t				number of LEDs
+ *		uint8_t				scale, fraction in 256ths
+ *	Returns:
+ *		uint8_t				non-zero while any LED is still lit
+ *
+ * One scale8 per byte, over the LED data as a flat run of
+ * bytes, so every channel of every LED is dimmed alike.
+ ************************************************************/
+
+extern uint8_t nscale_buffer(struct RGB *, uint8_t, uint8_t);
+
+/************************************************************
+ * fade_to_black: fade a run of LEDs towards black
+ *	Params:
+ *		struct RGB *		LED data
+ *		uint8_t				number of LEDs
+ *		uint8_t				amount to take off, in 256ths
+ *	Returns:
+ *		uint8_t				non-zero while any LED is still lit
+ *
+ * nscale_buffer by 255 - amount. Even an amount of 0 takes a
+ * channel at 1 to 0, so repeated calls always end at black.
+ ************************************************************/
+
+static inline uint8_t fade_to_black(struct RGB *data, uint8_t num_leds, uint8_t amount)
+{
+
+	return nscale_buffer(data, num_leds, ~amount);
+
+}
+
+#ifdef COLOUR_PROFILE
+/************************************************************
+ * colour_profile: cycles per LED of the last intensity_halve
+ * and nscale_buffer calls (Timer1 at CK/16, 16 cycle steps).
+ * nscale_buffer also times the per channel loop it replaces,
+ * scale_colour on each LED, over a copy of the first
+ * COLOUR_PROFILE_LEDS LEDs, for comparison
+ ************************************************************/
+
+#define COLOUR_PROFILE_LEDS		6
+
+extern volatile uint16_t colour_halve_cycles;
+extern volatile uint16_t colour_nscale_cycles;
+extern volatile uint16_t colour_nscale_channel_cycles;
+#endif
+
+#endif
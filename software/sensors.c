@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "sensors.h"
+#include "audio.h"
+
+#if SENSORS_ENABLE
+
+#if SENSORS_LDR && AUDIO_ENABLE && SENSORS_LDR_CHANNEL == AUDIO_CHANNEL
+#error "SENSORS_LDR_CHANNEL and AUDIO_CHANNEL are the same pin"
+#endif
+
+/********************************************************************************
+ * Measurements
+ *
+ * A measurement is a short run of single conversions, each started from the
+ * ADC interrupt of the one before, after which the ADC is switched off again:
+ *
+ *	- VCC: the bandgap is read against VCC, so the result goes up as VCC goes
+ *	  down: ADC = 1.1V * 1024 / VCC. The bandgap takes about 1ms to settle
+ *	  after it is selected, so the first SETTLE_CONVERSIONS are thrown away.
+ *	- LDR: one conversion, averaged with the ones before.
+ *
+ * With the ADC clock at F_CPU / 128 a conversion takes 83us at 20MHz, so a
+ * measurement is over in just over 1ms and costs the main loop nothing but a
+ * few short interrupts.
+ ********************************************************************************/
+
+#define SETTLE_CONVERSIONS	12
+
+// ADC result for a VCC in mV
+#define VCC_TO_ADC(mv)		((uint16_t) (1126400UL / (mv)))
+
+#define ADC_BANDGAP			((1 << MUX3) | (1 << MUX2))
+#define ADC_START			((1 << ADEN) | (1 << ADSC) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0))
+
+enum {
+	SENSORS_STATE_VCC,
+	SENSORS_STATE_LDR,
+};
+
+volatile uint8_t sensors_dim = 0;
+volatile uint8_t sensors_frame_ms = SENSORS_FRAME_MS;
+
+static uint8_t state;
+static uint8_t vcc_low = 0;
+
+#if SENSORS_VCC
+static uint8_t settle_count;
+#endif
+
+#if SENSORS_LDR
+static uint8_t light_level = 0xff;	// Averaged LDR reading, start at full brightness
+#endif
+
+/************************************************************
+ * sensors_start: start a measurement
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void sensors_start(void)
+{
+
+	if (ADCSRA & (1 << ADEN)) {
+		return;
+	}
+
+#if SENSORS_LDR
+	// Digital input and pull-up off on the LDR pin
+#if SENSORS_LDR_CHANNEL == 3
+	DIDR0 |= (1 << ADC3D);
+	PORTB &= ~(1 << PB3);
+#else
+	DIDR0 |= (1 << ADC2D);
+	PORTB &= ~(1 << PB4);
+#endif
+#endif
+
+#if SENSORS_VCC
+	state = SENSORS_STATE_VCC;
+	settle_count = SETTLE_CONVERSIONS;
+	ADMUX = ADC_BANDGAP;
+#else
+	state = SENSORS_STATE_LDR;
+	ADMUX = SENSORS_LDR_CHANNEL;
+#endif
+
+	ADCSRA = ADC_START;
+
+}
+
+/************************************************************
+ * sensors_sample: handle a finished conversion
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void sensors_sample(void)
+{
+
+	uint16_t value = ADC;
+	uint8_t dim = 0;
+
+#if SENSORS_VCC
+	if (state == SENSORS_STATE_VCC) {
+
+		if (settle_count) {
+			settle_count--;
+			ADCSRA = ADC_START;
+			return;
+		}
+
+		// With hysteresis, so a sagging battery does not flicker between the two
+		if (value > VCC_TO_ADC(SENSORS_VCC_LOW_MV)) {
+			vcc_low = 1;
+		} else if (value < VCC_TO_ADC(SENSORS_VCC_OK_MV)) {
+			vcc_low = 0;
+		}
+
+#if SENSORS_LDR
+		state = SENSORS_STATE_LDR;
+		ADMUX = SENSORS_LDR_CHANNEL;
+		ADCSRA = ADC_START;
+		return;
+#endif
+
+	}
+#endif
+
+#if SENSORS_LDR
+	if (state == SENSORS_STATE_LDR) {
+
+		light_level += ((int16_t) (value >> 2) - light_level) >> 2;
+
+	}
+
+	if (light_level < SENSORS_LDR_DARK) {
+		dim = 2;
+	} else if (light_level < SENSORS_LDR_DIM) {
+		dim = 1;
+	}
+#endif
+
+	ADCSRA = 0;
+
+	sensors_dim = dim + vcc_low;
+	sensors_frame_ms = vcc_low ? SENSORS_FRAME_MS_LOW : SENSORS_FRAME_MS;
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+/************************************************
+ * sensors.h
+ *
+ * Supply voltage and ambient light sensing
+ ************************************************/
+
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * VCC is measured against the internal 1.1V bandgap, which
+ * needs no extra parts. The light sensor is an LDR from the
+ * ADC pin to VCC with a resistor to GND, so more light gives a
+ * higher reading, and has to be enabled with -DSENSORS_LDR=1.
+ * It takes an ADC pin the crystal uses, see below. VCC sensing
+ * is on by default; turn it off with -DSENSORS_VCC=0 on a
+ * mains supply.
+ ************************************************************/
+
+#ifndef SENSORS_VCC
+#define SENSORS_VCC			1
+#endif
+
+#ifndef SENSORS_LDR
+#define SENSORS_LDR			0
+#endif
+
+/* ADC channel of the LDR: 2 is PB4, 3 is PB3 */
+#ifndef SENSORS_LDR_CHANNEL
+#define SENSORS_LDR_CHANNEL	2
+#endif
+
+#if SENSORS_LDR_CHANNEL != 2 && SENSORS_LDR_CHANNEL != 3
+#error "SENSORS_LDR_CHANNEL must be 2 (PB4) or 3 (PB3)"
+#endif
+
+/* PB4 and PB3 are the crystal with the default fuses, so the LDR
+ * needs the PLL clock, as the audio input does (see audio.h).
+ * VCC is measured inside the chip and works with either clock. */
+#ifndef CLOCK_INTERNAL
+#define CLOCK_INTERNAL		0
+#endif
+
+#if SENSORS_LDR && !CLOCK_INTERNAL
+#error "SENSORS_LDR needs PB4 or PB3, which the crystal uses: build for the PLL clock (FUSES_PLL in the Makefile)"
+#endif
+
+#define SENSORS_ENABLE		(SENSORS_VCC || SENSORS_LDR)
+
+#define SENSORS_PERIOD_MS	1000	// Time between measurements
+
+/* Low battery below VCC_LOW_MV, good again above VCC_OK_MV. The
+ * ATtiny85 needs 2.7V up to 10MHz and 4.5V at 20MHz, in a straight
+ * line between, so the defaults follow the clock: 100mV over that,
+ * and no lower than the 3.4V the LEDs still run at. That is 4.6V
+ * with the 20MHz crystal, where low battery only warns that the
+ * supply is about to leave the chip's safe range: running from a
+ * battery takes the 16MHz PLL build (3.9V) or a lower clock. */
+#define SENSORS_VCC_MIN_MV	(F_CPU <= 10000000UL ? 2700 : 2700 + (F_CPU - 10000000UL) / 1000000UL * 180)
+
+#ifndef SENSORS_VCC_LOW_MV
+#define SENSORS_VCC_LOW_MV	(SENSORS_VCC_MIN_MV + 100 > 3400 ? SENSORS_VCC_MIN_MV + 100 : 3400)
+#endif
+
+#ifndef SENSORS_VCC_OK_MV
+#define SENSORS_VCC_OK_MV	(SENSORS_VCC_LOW_MV + 200)
+#endif
+
+#if SENSORS_VCC_OK_MV <= SENSORS_VCC_LOW_MV
+#error "SENSORS_VCC_OK_MV must be above SENSORS_VCC_LOW_MV"
+#endif
+
+/* Ambient light (0 - 255) below which the LEDs are dimmed */
+#define SENSORS_LDR_DIM		96
+#define SENSORS_LDR_DARK	32
+
+/* Shortest time between frames, normally and on low battery */
+#define SENSORS_FRAME_MS		16
+#define SENSORS_FRAME_MS_LOW	48
+
+/* Public interface */
+
+/************************************************************
+ * Results of the last measurement
+ *
+ * sensors_dim is the number of brightness halvings to apply:
+ * one on low battery, and one or two more in the dark.
+ * sensors_frame_ms is the shortest time between two frames.
+ ************************************************************/
+
+extern volatile uint8_t sensors_dim;
+extern volatile uint8_t sensors_frame_ms;
+
+/************************************************************
+ * sensors_start: start a measurement
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * Returns at once. The conversions run from the ADC interrupt,
+ * which calls sensors_sample. Does nothing while the ADC is in
+ * use.
+ ************************************************************/
+
+extern void sensors_start(void);
+
+/************************************************************
+ * sensors_sample: handle a finished conversion
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * Called from the ADC interrupt.
+ ************************************************************/
+
+extern void sensors_sample(void);
+
+#endif
@@ -1,35 +1,107 @@
+#ifndef F_CPU
 #define	F_CPU	20000000UL
+#endif
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
 
 #include "ws2812.h"
+#include "colour.h"
+#include "audio.h"
+#include "sensors.h"
+#include "stack.h"
+#include "button.h"
+#include "sync.h"
+#include "stream.h"
+#include "task.h"
+
+/* Timer0 and Timer1, the PLL, the pin change interrupt, sleep and the ADC
+ * are set up for the ATtiny25/45/85 throughout */
+#if defined(__AVR__) && !defined(__AVR_ATtiny25__) && !defined(__AVR_ATtiny45__) && !defined(__AVR_ATtiny85__)
+#error "The snowflake firmware only builds for the ATtiny25/45/85"
+#endif
 
 #define	NUM_LEDS			18
-#define	NUM_PATTERNS		23
-#define FRAME_DELAY			16	// Number of milliseconds between frames
-#define COLOUR_FLASH_COUNT	6	// Speed of flashing rainbow (number of frames between halving steps)
-#define COLOUR_WALK_COUNT 	15	// Number of frames between moves of walking colours
-#define FADE_DELAY 			3	// Number of frames between successive steps of a fade down
-#define DEBOUNCE_COUNT_SHORT	10	// Number of 10ms slices after which a button press is registered as a short push
-#define DEBOUNCE_COUNT_LONG		100	// Number of 10ms slices after which a button press is registered as a long push
-#define DEBOUNCE_COUNT_MID		(DEBOUNCE_COUNT_LONG - DEBOUNCE_COUNT_SHORT) / 2 
+#define NUM_ARMS			6
+#define ARM_LEDS			3	// LEDs per arm (NUM_LEDS / NUM_ARMS)
+#define	NUM_PATTERNS		((uint8_t) (sizeof(pattern_functions) / sizeof(pattern_functions[0])))
+#define COLOUR_FLASH_MS		112	// Speed of flashing rainbow (ms between halving steps)
+#define COLOUR_WALK_MS	 	256	// Number of ms between moves of walking colours
+#define FADE_STEP_MS		48	// Number of ms between successive steps of a fade down
+#define FADE_STEP_AMOUNT	128	// Taken off each step of a fade down, in 256ths: about half
+#define FRAME_MS			16	// Number of ms between frames of keyframe animations
 #define DEMO_TIME_COUNT		500  // Number of 10ms slices between demo mode pattern switches
 
+#define PALETTE_SIZE		4	// Number of colours in the palette of an indexed frame
+
+/* Kinds of frame the frame buffer has to hold. Patterns that draw
+ * any other kind are left out, and the buffer shrinks to the
+ * largest kind left: 54 bytes for RGB, 21 for indexed and 11 for
+ * symmetric frames. Shader patterns need no buffer and are always
+ * in. E.g. -DFRAMEBUFFER_KINDS=FRAMEBUFFER_SYMMETRIC */
+#define FRAMEBUFFER_RGB			0x01
+#define FRAMEBUFFER_INDEXED		0x02
+#define FRAMEBUFFER_SYMMETRIC	0x04
+
+#ifndef FRAMEBUFFER_KINDS
+#define FRAMEBUFFER_KINDS	(FRAMEBUFFER_RGB | FRAMEBUFFER_INDEXED | FRAMEBUFFER_SYMMETRIC)
+#endif
+
+#if STREAM_ENABLE && !(FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB)
+#error "STREAM_ENABLE needs FRAMEBUFFER_RGB"
+#endif
+
 #define TRILOBE_INITIAL_STATE	0b00111000
 #define TRICIRCLE_INITIAL_STATE	0b00001000
 
 #define LED_PIN		PB0
 #define BUTTON		PB1
+#define SYNC_PIN	PB2		// INT0
+
+/* Sync line between snowflakes, build with e.g. -DSYNC_ROLE=SYNC_ROLE_MASTER */
+#define SYNC_ROLE_NONE		0
+#define SYNC_ROLE_MASTER	1	// Sends a pulse at every frame and pattern change
+#define SYNC_ROLE_SLAVE		2	// Draws frames and changes pattern with the master
+
+#ifndef SYNC_ROLE
+#define SYNC_ROLE	SYNC_ROLE_NONE
+#endif
+
+#if STREAM_ENABLE && SYNC_ROLE != SYNC_ROLE_NONE
+#error "STREAM_ENABLE needs the sync pin"
+#endif
+
+/* Divide the system clock by 32 while idle, see clock_slow. Build
+ * with -DCLOCK_SLOW=0 to run at F_CPU all the time */
+#ifndef CLOCK_SLOW
+#define CLOCK_SLOW			1
+#endif
+
+#define SYNC_FRAME_SLACK_MS		4						// Time a slave waits for a frame pulse after its own frame time
+#define SYNC_LOCK_COUNT			(2 * DEMO_TIME_COUNT)	// 10ms slices a slave follows the master after a pulse
 
 #define IS_BIT_SET(var, pos) ((var) & (1<<(pos)))
 
+#ifndef NUM_PARTICLES
+#define NUM_PARTICLES		16	// Size of the particle pool, 8, 16 or 32
+#endif
+
+#define PARTICLE_FADE		8	// Life lost per frame: a particle lasts 32 frames
+
+#if PALETTE_SIZE > (1 << WS2812_PALETTE_BITS)
+#error "PALETTE_SIZE does not fit in WS2812_PALETTE_BITS"
+#endif
+
 #define NUM_QUICK_FLASH		3	// Number of times to flash LEDS in quick flash
 #define QUICK_FLASH_DELAY   25 // Time in ms between steps of quick flash
+#define QUICK_FLASH_MS		(NUM_QUICK_FLASH * 8 * QUICK_FLASH_DELAY)	// Length of quick flash
 
 enum {
 	COLOUR_TYPE_COLD,
@@ -65,14 +137,13 @@ static uint8_t random_byte(void)
 }
 
 /******************************************************************
- * fill_rainbow_colours: Generate rainbow colours
+ * rainbow_colour: Generate the rainbow colour of one LED
  *
  * Parameters:
- * 		uint8_t num_leds	Number of leds to generate
- * 					colours for
- *		struct RGB *led_data	The LED data to fill in
+ * 		uint8_t position	LED to generate the colour for
+ * 		uint8_t num_leds	Number of leds in the rainbow
  * Returns:
- * 		void
+ * 		struct RGB			colour
  *
  * Intermediate colour generation could be done with sines for an
  * arbitrary number of colours, but I'm using a lookup table for up
@@ -85,134 +156,87 @@ static uint8_t random_byte(void)
  *
  * P = primary colour, reset phase
  * i = intermediate colour
+ *
+ * This works out one LED on its own (three 8-bit divisions and two
+ * table lookups), so shader patterns can call it per pixel.
  ******************************************************************/
 
-void fill_rainbow_colours(struct RGB *led_data, uint8_t num_leds) 
-{
-
-	/* Colour lookup tables. */ 
-	uint8_t intermediate_colours_2[2] = { 127, 63 };
-	uint8_t intermediate_colours_3[3] = { 127, 85, 42};
-	uint8_t intermediate_colours_4[4] = { 127, 95, 63, 32 };
-	uint8_t intermediate_colours_5[5] = { 127, 102, 76, 51, 26};
+/* Colour lookup tables, one row per number of intermediate colours */ 
+static const uint8_t intermediate_colours[4][5] PROGMEM = {
+	{ 127, 63 },
+	{ 127, 85, 42},
+	{ 127, 95, 63, 32 },
+	{ 127, 102, 76, 51, 26},
+};
 
-	uint8_t *intermediate_colours[4] = { 
-		intermediate_colours_2,
-		intermediate_colours_3,
-		intermediate_colours_4,
-		intermediate_colours_5,
-	};
+static struct RGB rainbow_colour(uint8_t position, uint8_t num_leds)
+{
 
 	uint8_t num_rainbow = (num_leds > 18) ? 18 : num_leds;
 	uint8_t num_intermediate_colours = (num_rainbow / 3);
-	uint8_t i;
-	uint8_t current_colour = 0;
 	uint8_t current_triplet[3] = {0, 0, 0};
 
-	
-	for (i = 0; i < num_leds; i++) {
+	position %= num_intermediate_colours * 3;
 
-		uint8_t phase = i % num_intermediate_colours;
+	uint8_t current_colour = position / num_intermediate_colours;
+	uint8_t phase = position % num_intermediate_colours;
+	const uint8_t *table = intermediate_colours[num_intermediate_colours - 3];
 
-		if (phase == 0) {
+	if (phase == 0) {
 		
-			// First phase: 1 colour is 255, the rest is 0
-			current_triplet[0] = current_triplet[1] = current_triplet[2] = 0;
-			current_triplet[current_colour] = 127;
+		// First phase: 1 colour is 255, the rest is 0
+		current_triplet[current_colour] = 127;
 
 	} else {
 
-			// Intermediate phases: lookup colours in lookup table
-			current_triplet[current_colour] = intermediate_colours[num_intermediate_colours - 3][phase - 1];
-			current_triplet[(current_colour+1)%3] = intermediate_colours[num_intermediate_colours - 3][num_intermediate_colours - phase - 1];
-			
-
-		}
-
-		led_data[i].red = current_triplet[0];
-		led_data[i].green = current_triplet[1];
-		led_data[i].blue = current_triplet[2];
-
-		// Go to next colour if necessary
-		if (phase == num_intermediate_colours - 1) {
-			current_colour++;
-		}
-
-	}
-
-
-}
-
-/******************************************************************
- * rotate_right: rotate LED data one step to the right
- *
- * Parameters:
- *		struct RGB *data	LED data
- * 		uint8_t num_leds	Number of LEDs
- ******************************************************************/
- 
-static void rotate_right(struct RGB *data, uint8_t num_leds)
-{
-
-	uint8_t i = 0;
-
-	struct RGB temp = data[num_leds - 1];
+		// Intermediate phases: lookup colours in lookup table
+		current_triplet[current_colour] = pgm_read_byte(&table[phase - 1]);
+		current_triplet[current_colour == 2 ? 0 : current_colour + 1] = pgm_read_byte(&table[num_intermediate_colours - phase - 1]);
 
-	for (i = num_leds - 1; i > 0 ; i--) {
-		data[i] = data[i - 1];
 	}
 
-	data[0] = temp;
+	return (struct RGB){ .red = current_triplet[0], .green = current_triplet[1], .blue = current_triplet[2] };
 
 }
 
 /******************************************************************
- * intensity_halve: halve intensity
+ * fill_rainbow_colours: Generate rainbow colours
  *
  * Parameters:
- *		struct RGB *data	LED data
- * 		uint8_t num_leds	Number of LEDs
- *
+ * 		uint8_t num_leds	Number of leds to generate
+ * 					colours for
+ *		struct RGB *led_data	The LED data to fill in
  * Returns:
- * 		uint8_t	remaining_colours Number of colors with re-
- * 					maining intensity 
+ * 		void
  ******************************************************************/
 
-static uint8_t intensity_halve(struct RGB *data, uint8_t num_leds) 
+void fill_rainbow_colours(struct RGB *led_data, uint8_t num_leds) 
 {
 
 	uint8_t i;
-	uint8_t remaining_colours = 0;
-
-	for (i = 0 ; i < num_leds; i++) {
-		data[i].red >>= 1;
-		if (data[i].red) {remaining_colours++;}
-		data[i].green >>= 1;
-		if (data[i].green) {remaining_colours++;}
-		data[i].blue >>= 1;
-		if (data[i].blue) {remaining_colours++;}
+	
+	for (i = 0; i < num_leds; i++) {
+		led_data[i] = rainbow_colour(i, num_leds);
 	}
 
-	return remaining_colours;
 }
 
 /******************************************************************
- * fill_colours: fill with warm or cold colours
+ * fill_colours: fill one arm with warm or cold colours
  *
  * Parameters:
- *		struct RGB *data	LED data
- * 		uint8_t num_leds	Number of LEDs
+ *		struct RGB *sector	Arm colours, outer to inner
  * 		uint8_t colour_type	Colour type
  ******************************************************************/
 
-static void fill_colours(struct RGB *data, uint8_t num_leds, uint8_t colour_type)
+static void fill_colours(struct RGB *sector, uint8_t colour_type)
 {
 
 	uint8_t i;
 	uint8_t index_red = 0;
 	uint8_t rgb_values[3][3] = {
-		{ 128, 0, 0},
 		{ 76, 76, 0},
+		{ 128, 0, 0},
 		{ 102, 51, 0}, 
 	};
 
@@ -227,71 +251,58 @@ static void fill_colours(struct RGB *data, uint8_t num_leds, uint8_t colour_type
 			break;
 	}
 
-	// Deal with idiosyncratic wiring
-	data[0].red = rgb_values[1][index_red];
-	data[0].green = rgb_values[1][1];
-	data[0].blue = rgb_values[1][2 - index_red];
-	data[1].red = rgb_values[0][index_red];
-	data[1].green = rgb_values[0][1];
-	data[1].blue = rgb_values[0][2 - index_red];
-
-
-	for (i = 2; i < num_leds; i++) {
-
+	for (i = 0; i < ARM_LEDS; i++) {
 
-		data[i].red = rgb_values[i % 3][index_red];
-		data[i].green = rgb_values[i % 3][1];
-		data[i].blue = rgb_values[i % 3][2 - index_red];
+		sector[i].red = rgb_values[i][index_red];
+		sector[i].green = rgb_values[i][1];
+		sector[i].blue = rgb_values[i][2 - index_red];
 
 	}
 }
 
 /******************************************************************
- * fill_range_colour: fill a range of LEDs with a colour
+ * set_index: set the palette index of one LED
  *
  * Parameters:
- *		struct RGB *data	LED data
- *		uint8_t start		First led
- * 		uint8_t end			Last led (will also be filled)
- *		struct RGB colour	colour
- *
- * Please note: no boundary checking
+ *		uint8_t *index		LED palette indices
+ *		uint8_t led			LED to set
+ *		uint8_t value		palette index
  ******************************************************************/
 
-static void fill_range_colour(struct RGB *data, uint8_t start, uint8_t end, struct RGB colour)
+static void set_index(uint8_t *index, uint8_t led, uint8_t value)
 {
 
-	uint8_t i;
-
-	for (i = start; i <= end; i++) {
-		data[i].red = colour.red;
-		data[i].green = colour.green;
-		data[i].blue = colour.blue;
+#if WS2812_PALETTE_BITS == 4
+	if (led & 1) {
+		index[led >> 1] = (index[led >> 1] & 0x0f) | (value << 4);
+	} else {
+		index[led >> 1] = (index[led >> 1] & 0xf0) | value;
 	}
+#else
+	index[led] = value;
+#endif
 
 }
 
 /******************************************************************
- * fill_some_colour: fill a number of LEDs with a colour
+ * fill_range_index: set a range of LEDs to a palette index
  *
  * Parameters:
- *		struct RGB *data	LED data
- *		uint8_t num_leds	Number of LEDs to fill
- *		uint8_t *leds		LEDs to fill
- *		struct RGB colour	colour
+ *		uint8_t *index		LED palette indices
+ *		uint8_t start		First led
+ * 		uint8_t end			Last led (will also be filled)
+ *		uint8_t value		palette index
  *
  * Please note: no boundary checking
  ******************************************************************/
 
-static void fill_some_colour(struct RGB *data, uint8_t num_leds, uint8_t *leds, struct RGB colour)
+static void fill_range_index(uint8_t *index, uint8_t start, uint8_t end, uint8_t value)
 {
 
 	uint8_t i;
 
-	for (i = 0; i < num_leds; i++) {
-		data[leds[i]].red = colour.red;
-		data[leds[i]].green = colour.green;
-		data[leds[i]].blue = colour.blue;
+	for (i = start; i <= end; i++) {
+		set_index(index, i, value);
 	}
 
 }
@@ -320,18 +331,20 @@ static struct RGB get_colour_from_parameter(uint8_t colour_type)
 		}
 	}
 
+	colour = (struct RGB){ 0 };
+
 	switch (colour_type) {
 
 		case SINGLE_COLOUR_RED:
-			colour = (struct RGB){ 0, 0x80, 0 };  // The RHS is a 'Compound Literal'. Google it
+			colour = (struct RGB){ .red = 0x80 };  // The RHS is a 'Compound Literal'. Google it
 		break;
 
 		case SINGLE_COLOUR_GREEN:
-			colour = (struct RGB){ 0x60, 0, 0 }; // 0x60 to equalise brightness. Human eye is more sensitive to green
+			colour = (struct RGB){ .green = 0x80 };
 		break;
 
 		case SINGLE_COLOUR_BLUE:
-			colour = (struct RGB) { 0, 0, 0x80 };
+			colour = (struct RGB) { .blue = 0x80 };
 		break;
 
 		case SINGLE_COLOUR_RANDOM:
@@ -353,83 +366,241 @@ static struct RGB get_colour_from_parameter(uint8_t colour_type)
  * 1/60 s. I am using (void *) type to pass a parameter to a pattern
  * function for future flexibility, even though I am currently only 
  * using it as a uint8_t
+ *
+ * Patterns that draw a frame buffer may be left out of the table by
+ * FRAMEBUFFER_KINDS, hence PATTERN_OPTIONAL.
  ******************************************************************/
 
-static uint8_t fill_single_colour(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t rainbow(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t rainbow_wheel(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t fade_colours(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t crazy(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t walking_colour(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t walking_bar(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t trilobe(struct RGB *, uint8_t, uint8_t, void *);
-static uint8_t tricircle(struct RGB *, uint8_t, uint8_t, void *);
-
-static uint8_t fade_down(struct RGB *, uint8_t, uint8_t, void *);
+#define PATTERN_OPTIONAL	__attribute__((unused))
+
+static uint8_t fill_single_colour(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t rainbow(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t rainbow_wheel(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+static uint8_t fade_colours(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t crazy(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t walking_colour(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+static uint8_t walking_bar(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+static uint8_t trilobe(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t tricircle(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t kaleidoscope(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t particles(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t animation(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t frost(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t aurora(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+#if AUDIO_ENABLE
+static uint8_t audio_rings(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+static uint8_t audio_arms(struct RGB *, uint8_t, uint8_t, void *, uint16_t *) PATTERN_OPTIONAL;
+#endif
+#if STREAM_ENABLE
+static uint8_t stream(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+#endif
+
+static uint8_t fade_down(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+static uint8_t fade_down_shader(struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
+
+static struct RGB rainbow_wheel_shader(uint8_t, uint16_t, void *);
+static struct RGB walking_colour_shader(uint8_t, uint16_t, void *);
+static struct RGB walking_bar_shader(uint8_t, uint16_t, void *);
 
 struct patternfunc {
-	uint8_t (*run_pattern) (struct RGB *, uint8_t, uint8_t, void *);
+	uint8_t (*run_pattern) (struct RGB *, uint8_t, uint8_t, void *, uint16_t *);
 	void *extra_parameter;
+	uint8_t flags;
+	struct RGB (*shader) (uint8_t, uint16_t, void *);
 };
 
-struct colour_param {
-	uint8_t *counter;
-	uint8_t colour_type;
+/*** Pattern flags ***/
+
+#define PATTERN_FLAG_INDEXED	0x01	// Pattern draws an indexed frame
+#define PATTERN_FLAG_SHADER		0x02	// Pattern has no frame, its shader draws each LED
+#define PATTERN_FLAG_SYMMETRIC	0x04	// Pattern draws one arm, which is copied to all arms
+
+/******************************************************************
+ * struct indexed_frame: palette indexed frame
+ *
+ * Patterns with PATTERN_FLAG_INDEXED get their struct RGB * frame
+ * buffer as one of these. Each LED is a WS2812_PALETTE_BITS index
+ * into a small palette, which send_frame_indexed expands while
+ * sending. Changing a palette entry recolours all of its LEDs, so
+ * patterns that only swap colours around never touch the indices.
+ ******************************************************************/
+
+struct indexed_frame {
+	struct RGB palette[PALETTE_SIZE];
+	uint8_t index[(NUM_LEDS * WS2812_PALETTE_BITS + 7) / 8];
+};
+
+/******************************************************************
+ * struct symmetric_frame: frame with six-fold symmetry
+ *
+ * Patterns with PATTERN_FLAG_SYMMETRIC only draw the ARM_LEDS
+ * colours of one arm (the sector), from the outside in. A map in
+ * flash gives the sector position of every LED, and
+ * send_frame_mapped copies the sector to all arms while sending.
+ * The maps also take care of the wiring: the first arm starts with
+ * its outer LED, all others with their middle LED.
+ *
+ * A pattern picks the map, so the same sector can be shown as
+ * plain copies, with every other arm inside out, or twisted one
+ * LED further on each arm.
+ ******************************************************************/
+
+struct symmetric_frame {
+	const uint8_t *map;
+	struct RGB sector[ARM_LEDS];
+};
+
+static const uint8_t symmetry_map_plain[NUM_LEDS] PROGMEM = {
+	0, 1, 2,	1, 0, 2,	1, 0, 2,	1, 0, 2,	1, 0, 2,	1, 0, 2,
 };
 
-struct trilobe_param {
-	uint8_t *counter;
-	uint8_t *state;
+static const uint8_t symmetry_map_alternate[NUM_LEDS] PROGMEM = {
+	0, 1, 2,	1, 2, 0,	1, 0, 2,	1, 2, 0,	1, 0, 2,	1, 2, 0,
 };
 
-uint8_t trilobe_initial_state = TRILOBE_INITIAL_STATE;
+static const uint8_t symmetry_map_twist[NUM_LEDS] PROGMEM = {
+	0, 1, 2,	2, 1, 0,	0, 2, 1,	1, 0, 2,	2, 1, 0,	0, 2, 1,
+};
+
+#define NUM_SYMMETRY_MAPS	3
+
+static const uint8_t * const symmetry_maps[NUM_SYMMETRY_MAPS] PROGMEM = {
+	symmetry_map_plain,
+	symmetry_map_alternate,
+	symmetry_map_twist,
+};
+
+// The frame buffer holds any kind of frame in FRAMEBUFFER_KINDS
+#define MAX(a, b)			((a) > (b) ? (a) : (b))
+#define RGB_FRAME_BYTES		((FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB) ? sizeof(struct RGB) * NUM_LEDS : 1)
+#define INDEXED_FRAME_BYTES	((FRAMEBUFFER_KINDS & FRAMEBUFFER_INDEXED) ? sizeof(struct indexed_frame) : 1)
+#define SYMMETRIC_FRAME_BYTES	((FRAMEBUFFER_KINDS & FRAMEBUFFER_SYMMETRIC) ? sizeof(struct symmetric_frame) : 1)
+#define FRAMEBUFFER_BYTES	MAX(RGB_FRAME_BYTES, MAX(INDEXED_FRAME_BYTES, SYMMETRIC_FRAME_BYTES))
+
+// Static rather than allocated, so the linker and the RAM check in the Makefile count it
+uint8_t framebuffer[FRAMEBUFFER_BYTES];
+
+/******************************************************************
+ * struct shader_frame: frame drawn by a shader
+ *
+ * Patterns with PATTERN_FLAG_SHADER do not use the frame buffer.
+ * Their pattern function only moves the animation on, and their
+ * shader works out each LED while send_frame_shader sends it. So a
+ * shader must stay within WS2812_SHADER_BUDGET_CYCLES: 360 cycles
+ * for WS2812 at 20MHz with calibration on, half the reset time less
+ * the calibration.
+ *
+ * Worst cases, counted from the code at about 60 cycles for an
+ * 8-bit division and 34 for a scale8:
+ *
+ *	rainbow_wheel_shader	250		three divisions in rainbow_colour
+ *	walking_*_shader		230		two walker_cover, one scale_colour
+ *	dimmed_shader			+90		while fading, shifts of 3 channels
+ *	composite_shader		+210	long press flash and indicator on
+ *
+ * The shaders alone are inside the budget. A rainbow_wheel under the
+ * long press flash (about 490) runs into the margin, but with the
+ * calibration it still stays below 32us, well within the 50us reset
+ * time. Build with -DWS2812_SHADER_PROFILE to measure them on the
+ * target: the longest call and the calls over budget are kept.
+ *
+ * Fading and flashing a shader frame dims the shader output.
+ ******************************************************************/
+
+struct shader_frame {
+	struct patternfunc *pf;		// Pattern whose shader draws the frame
+	uint8_t shift;				// Dimming: number of intensity halvings
+};
+
+struct shader_frame current_shader_frame = { NULL, 0 };
+uint16_t frame_time = 0;		// ms_clock at the last pattern step, passed to shaders
+uint16_t pattern_start = 0;		// ms_clock at the start of the current animation cycle
+
+struct colour_param {
+	uint8_t colour_type;
+};
 
 struct tricircle_param {
-	uint8_t *counter;
-	uint8_t *state;
 	uint8_t colour_type;
 };
 
-uint8_t tricircle_initial_state = TRICIRCLE_INITIAL_STATE;
-
-uint8_t pattern_counter = 0;
-struct colour_param fcp_cold = {&pattern_counter, COLOUR_TYPE_COLD};
-struct colour_param fcp_warm = {&pattern_counter, COLOUR_TYPE_WARM};
-struct colour_param wcp_red = {&pattern_counter, SINGLE_COLOUR_RED};
-struct colour_param wcp_green = {&pattern_counter, SINGLE_COLOUR_GREEN};
-struct colour_param wcp_blue = {&pattern_counter, SINGLE_COLOUR_BLUE};
-struct colour_param wcp_random = {&pattern_counter, SINGLE_COLOUR_RANDOM};
-struct trilobe_param tcp = {&pattern_counter, &trilobe_initial_state};
-struct tricircle_param tccp_red = {&pattern_counter, &trilobe_initial_state, SINGLE_COLOUR_RED};
-struct tricircle_param tccp_green = {&pattern_counter, &trilobe_initial_state, SINGLE_COLOUR_GREEN};
-struct tricircle_param tccp_blue = {&pattern_counter, &trilobe_initial_state, SINGLE_COLOUR_BLUE};
-struct tricircle_param tccp_random = {&pattern_counter, &trilobe_initial_state, SINGLE_COLOUR_RANDOM};
+uint8_t pattern_position = 0;	// Animation position of shader patterns
+struct RGB pattern_colour;		// Colour of walking and circling patterns
+struct colour_param fcp_cold = {COLOUR_TYPE_COLD};
+struct colour_param fcp_warm = {COLOUR_TYPE_WARM};
+struct colour_param wcp_red = {SINGLE_COLOUR_RED};
+struct colour_param wcp_green = {SINGLE_COLOUR_GREEN};
+struct colour_param wcp_blue = {SINGLE_COLOUR_BLUE};
+struct colour_param wcp_random = {SINGLE_COLOUR_RANDOM};
+struct tricircle_param tccp_red = {SINGLE_COLOUR_RED};
+struct tricircle_param tccp_green = {SINGLE_COLOUR_GREEN};
+struct tricircle_param tccp_blue = {SINGLE_COLOUR_BLUE};
+struct tricircle_param tccp_random = {SINGLE_COLOUR_RANDOM};
+
+struct particle_param {
+	uint8_t spawn;		// Chance of a new particle per frame, in 64ths
+	uint8_t fall;		// Non-zero: particles fall from the tip to the centre of their arm
+};
+
+struct particle_param pp_sparkle = {6, 0};
+struct particle_param pp_snowfall = {4, 1};
+
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB
+#include "animation_data.h"
+#endif
 
 /*** Pattern table. Patterns are cycled through this consecutively ***/
-struct patternfunc pattern_functions[NUM_PATTERNS] = {
+struct patternfunc pattern_functions[] = {
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB
 	{fill_single_colour,(void *) SINGLE_COLOUR_RED },	
 	{fill_single_colour,(void *) SINGLE_COLOUR_GREEN },	
 	{fill_single_colour,(void *) SINGLE_COLOUR_BLUE },	
 	{fill_single_colour,(void *) SINGLE_COLOUR_RANDOM },	
 	{rainbow, (void *) 0 },	
-	{rainbow, (void *) &pattern_counter },	
-	{rainbow_wheel, (void *) &pattern_counter },	
-	{fade_colours, (void *) &fcp_cold },	
-	{fade_colours, (void *) &fcp_warm },	
-	{crazy, (void *) &pattern_counter },	
-	{walking_colour, (void *) &wcp_red },	
-	{walking_colour, (void *) &wcp_green },	
-	{walking_colour, (void *) &wcp_blue },	
-	{walking_colour, (void *) &wcp_random },	
-	{walking_bar, (void *) &wcp_red },	
-	{walking_bar, (void *) &wcp_green },	
-	{walking_bar, (void *) &wcp_blue },	
-	{walking_bar, (void *) &wcp_random },	
-	{trilobe, (void *) &tcp },	
-	{tricircle, (void *) &tccp_red },	
-	{tricircle, (void *) &tccp_green },	
-	{tricircle, (void *) &tccp_blue },	
-	{tricircle, (void *) &tccp_random },	
+	{rainbow, (void *) 1 },	
+#endif
+	{rainbow_wheel, NULL, PATTERN_FLAG_SHADER, rainbow_wheel_shader },	
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_SYMMETRIC
+	{fade_colours, (void *) &fcp_cold, PATTERN_FLAG_SYMMETRIC },	
+	{fade_colours, (void *) &fcp_warm, PATTERN_FLAG_SYMMETRIC },	
+#endif
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB
+	{crazy, NULL },	
+#endif
+	{walking_colour, (void *) &wcp_red, PATTERN_FLAG_SHADER, walking_colour_shader },	
+	{walking_colour, (void *) &wcp_green, PATTERN_FLAG_SHADER, walking_colour_shader },	
+	{walking_colour, (void *) &wcp_blue, PATTERN_FLAG_SHADER, walking_colour_shader },	
+	{walking_colour, (void *) &wcp_random, PATTERN_FLAG_SHADER, walking_colour_shader },	
+	{walking_bar, (void *) &wcp_red, PATTERN_FLAG_SHADER, walking_bar_shader },	
+	{walking_bar, (void *) &wcp_green, PATTERN_FLAG_SHADER, walking_bar_shader },	
+	{walking_bar, (void *) &wcp_blue, PATTERN_FLAG_SHADER, walking_bar_shader },	
+	{walking_bar, (void *) &wcp_random, PATTERN_FLAG_SHADER, walking_bar_shader },	
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_INDEXED
+	{trilobe, NULL, PATTERN_FLAG_INDEXED },	
+#endif
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_SYMMETRIC
+	{tricircle, (void *) &tccp_red, PATTERN_FLAG_SYMMETRIC },	
+	{tricircle, (void *) &tccp_green, PATTERN_FLAG_SYMMETRIC },	
+	{tricircle, (void *) &tccp_blue, PATTERN_FLAG_SYMMETRIC },	
+	{tricircle, (void *) &tccp_random, PATTERN_FLAG_SYMMETRIC },	
+	{kaleidoscope, NULL, PATTERN_FLAG_SYMMETRIC },	
+#endif
+#if FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB
+	{particles, (void *) &pp_sparkle },	
+	{particles, (void *) &pp_snowfall },	
+	{animation, (void *) animation_snowflake },	
+	{frost, NULL },	
+	{aurora, NULL },	
+#endif
+#if AUDIO_ENABLE && (FRAMEBUFFER_KINDS & FRAMEBUFFER_SYMMETRIC)
+	{audio_rings, NULL, PATTERN_FLAG_SYMMETRIC },	
+#endif
+#if AUDIO_ENABLE && (FRAMEBUFFER_KINDS & FRAMEBUFFER_RGB)
+	{audio_arms, NULL },	
+#endif
+#if STREAM_ENABLE
+	{stream, NULL },	
+#endif
 };
 
 /*** Status codes ***/
@@ -451,8 +622,198 @@ enum {
  * 		1 - Frame needs to be sent
  * 		2 - No change to data
  * 		>2 - pattern specific meaning, is passed into the next call
+ *
+ * Patterns are not called every frame. Each call sets *wait to the
+ * number of ms until its next change, and the main loop sleeps until
+ * then. A pattern that will never change again sets
+ * PATTERN_WAIT_FOREVER, and the device powers down until the button
+ * is pressed.
+ *
+ * All speeds are in ms, and patterns that move work out where they
+ * are from the time (frame_time) with pattern_step, rather than by
+ * counting their calls. So a late call catches up instead of slowing
+ * the pattern down, and nothing depends on how often frames go out.
  *******************************************************************/
 
+#define PATTERN_WAIT_FOREVER	0xffff
+
+/******************************************************************
+ * pattern_step: animation step of a pattern at frame_time
+ *
+ * Parameter
+ * 		uint16_t period		Time of one step in ms
+ * 		uint8_t steps		Number of steps in one animation cycle
+ * 		uint16_t *wait		Returns the time until the next step
+ * Returns:
+ * 		uint8_t				Step in the cycle, 0 .. steps - 1
+ *
+ * pattern_start is moved on by a whole cycle every time one has
+ * passed, so the 16-bit ms clock never wraps under a pattern. The
+ * main loop sets it when a pattern starts.
+ ******************************************************************/
+
+static uint8_t pattern_step(uint16_t period, uint8_t steps, uint16_t *wait)
+{
+
+	uint16_t cycle = period * steps;
+	uint16_t elapsed = frame_time - pattern_start;
+
+	while (elapsed >= cycle) {
+		pattern_start += cycle;
+		elapsed -= cycle;
+	}
+
+	*wait = period - elapsed % period;
+
+	return elapsed / period;
+
+}
+
+/******************************************************************
+ * pattern_wait: time until the next step of a pattern
+ *
+ * Parameter
+ * 		uint16_t period		Time of one step in ms
+ * Returns:
+ * 		uint16_t			Time until the next step
+ *
+ * For patterns that move on a step per call, like the flashing
+ * ones. The steps stay on the period grid from the start of the
+ * pattern, however late the call.
+ ******************************************************************/
+
+static uint16_t pattern_wait(uint16_t period)
+{
+
+	uint16_t wait;
+
+	pattern_step(period, 1, &wait);
+
+	return wait;
+
+}
+
+/******************************************************************
+ * pattern_phase: animation step and the way to the next one
+ *
+ * Parameter
+ * 		uint16_t period		Time of one step in ms
+ * 		uint8_t steps		Number of steps in one animation cycle
+ * 		uint16_t *wait		Returns the time until the next frame
+ * Returns:
+ * 		uint16_t			Step in 8.8 fixed point
+ *
+ * Like pattern_step, but with the fraction of the step that has
+ * passed in the low byte, for patterns that move smoothly. These
+ * want to run every frame, so the wait is at most FRAME_MS.
+ ******************************************************************/
+
+static uint16_t pattern_phase(uint16_t period, uint8_t steps, uint16_t *wait)
+{
+
+	uint16_t next;
+	uint8_t step = pattern_step(period, steps, &next);
+
+	*wait = (next < FRAME_MS) ? next : FRAME_MS;
+
+	return ((uint16_t) step << 8) | (uint8_t) ((((uint32_t) (period - next)) << 8) / period);
+
+}
+
+/******************************************************************
+ * Keyframe animations
+ *
+ * A keyframe animation only says what the LEDs look like at each
+ * keyframe. The key function gives the colour of one LED (or
+ * palette entry, or sector entry) in one keyframe, and keyframes
+ * follow each other every period ms, going round.
+ *
+ * keyframe_time works out which keyframe the animation has just
+ * left and how far it is to the next one, and asks to be called
+ * again in a frame. keyframe_colour then blends the two keyframes
+ * for one LED, so things move smoothly from one to the next
+ * without the pattern doing anything per frame. It is cheap
+ * enough for a shader: two key calls, and three scale8 calls
+ * only if the LED changes between the two keyframes.
+ ******************************************************************/
+
+struct keyframes {
+	struct RGB (*key)(uint8_t, uint8_t);	// Colour of an LED in a keyframe
+	uint8_t num_keys;						// Number of keyframes
+	uint16_t period;						// Time between keyframes in ms
+};
+
+uint8_t keyframe_key = 0;		// Keyframe the animation has just left
+uint8_t keyframe_blend = 0;		// Way to the next keyframe, in 256ths
+
+/******************************************************************
+ * keyframe_time: move a keyframe animation on to frame_time
+ *
+ * Parameter
+ * 		struct keyframes *	Animation
+ * 		uint16_t *wait		Returns the time until the next frame
+ ******************************************************************/
+
+static void keyframe_time(const struct keyframes *keyframes, uint16_t *wait)
+{
+
+	uint16_t phase = pattern_phase(keyframes->period, keyframes->num_keys, wait);
+
+	keyframe_key = phase >> 8;
+	keyframe_blend = phase;
+
+}
+
+/******************************************************************
+ * keyframe_colour: colour of an LED between two keyframes
+ *
+ * Parameter
+ * 		struct keyframes *	Animation
+ * 		uint8_t index		LED
+ * Returns:
+ * 		struct RGB			colour
+ ******************************************************************/
+
+static struct RGB keyframe_colour(const struct keyframes *keyframes, uint8_t index)
+{
+
+	uint8_t next_key = keyframe_key + 1;
+
+	if (next_key == keyframes->num_keys) {
+		next_key = 0;
+	}
+
+	struct RGB from = keyframes->key(index, keyframe_key);
+	struct RGB to = keyframes->key(index, next_key);
+
+	if (memcmp(&from, &to, sizeof(struct RGB)) == 0) {
+		return from;
+	}
+
+	return blend_colour(from, to, keyframe_blend);
+
+}
+
+/******************************************************************
+ * keyframe_fill: fill colours between two keyframes
+ *
+ * Parameter
+ * 		struct keyframes *	Animation
+ * 		struct RGB *		Colours to fill
+ * 		uint8_t num			Number of colours
+ ******************************************************************/
+
+static void keyframe_fill(const struct keyframes *keyframes, struct RGB *colours, uint8_t num)
+{
+
+	uint8_t i;
+
+	for (i = 0; i < num; i++) {
+		colours[i] = keyframe_colour(keyframes, i);
+	}
+
+}
+
 /******************************************************************
  * fade_down: fade down to zero intensity
  *
@@ -460,50 +821,57 @@ enum {
  * 		struct RGB *  		LED data to write
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
- * 		uint8_t count 		Running counter
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
  *
  * This is a special pattern function that is called between tran-
  * sitions between the other pattern functions. It fades the LEDs
  * down to zero intensity
  *******************************************************************/
 
-static uint8_t fade_down (struct RGB *data, uint8_t num_leds, uint8_t status, void *count)
+static uint8_t fade_down (struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
 {
 
-	uint8_t new_status = PATTERN_STATUS_REFRESH;
-	uint8_t *counter = (uint8_t *) count;
+	*wait = pattern_wait(FADE_STEP_MS);
 
-	switch (status) {
+	if (fade_to_black(data, num_leds, FADE_STEP_AMOUNT)) {
+		return PATTERN_STATUS_REFRESH;
+	}
 
-		case PATTERN_STATUS_NEW:
-			*counter = 0;
-			intensity_halve(data, num_leds);
-			new_status = PATTERN_STATUS_REFRESH;
-			break;
+	return PATTERN_STATUS_FADE_DONE;
 
-		default:
-			(*counter)++;
-			break;
+}
 
-	}
+/******************************************************************
+ * fade_down_shader: fade a shader frame down to zero intensity
+ *
+ * Parameter
+ * 		struct RGB *  		Not used
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * Same as fade_down, but halves the shader output instead of the
+ * frame buffer.
+ *******************************************************************/
 
-	if ( *counter == FADE_DELAY) {
+static uint8_t fade_down_shader (struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
 
-		*counter = 0;
-		
-		if (intensity_halve(data, num_leds)) {
-			new_status = PATTERN_STATUS_REFRESH;
-		} else {
-			new_status = PATTERN_STATUS_FADE_DONE;
-		}
+	*wait = pattern_wait(FADE_STEP_MS);
 
+	if (status == PATTERN_STATUS_NEW) {
+		current_shader_frame.shift = 0;
 	}
 
-	return new_status;
-
-}
+	if (++current_shader_frame.shift < 8) {
+		return PATTERN_STATUS_REFRESH;
+	}
 
+	return PATTERN_STATUS_FADE_DONE;
 
+}
 
 /******************************************************************
  * Single color - show a single color
@@ -517,9 +885,10 @@ static uint8_t fade_down (struct RGB *data, uint8_t num_leds, uint8_t status, vo
  * 				1	-	Green
  * 				2	-	Blue
  * 				3	-	Random color
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-static uint8_t fill_single_colour(struct RGB *data, uint8_t num_leds, uint8_t status, void *mode)
+static uint8_t fill_single_colour(struct RGB *data, uint8_t num_leds, uint8_t status, void *mode, uint16_t *wait)
 {
 
 	uint8_t i;
@@ -531,6 +900,8 @@ static uint8_t fill_single_colour(struct RGB *data, uint8_t num_leds, uint8_t st
 		}
 	}
 
+	*wait = PATTERN_WAIT_FOREVER;
+
 	if ( status == PATTERN_STATUS_NEW ) {
 		status = PATTERN_STATUS_REFRESH;
 		for(i = 0; i < num_leds; i++) {
@@ -538,21 +909,19 @@ static uint8_t fill_single_colour(struct RGB *data, uint8_t num_leds, uint8_t st
 			switch ((int) mode) {
 
 				case SINGLE_COLOUR_RED:
-					data[i] = (struct RGB){ 0, 0x80, 0 };  // The RHS is a 'Compound Literal'. Google it
+					data[i] = (struct RGB){ .red = 0x80 };  // The RHS is a 'Compound Literal'. Google it
 				break;
 
 				case SINGLE_COLOUR_GREEN:
-					data[i] = (struct RGB){ 0x60, 0, 0 }; // 0x60 to equalise brightness. Human eye is more sensitive to green
+					data[i] = (struct RGB){ .green = 0x80 };
 				break;
 
 				case SINGLE_COLOUR_BLUE:
-					data[i] = (struct RGB) { 0, 0, 0x80 };
+					data[i] = (struct RGB) { .blue = 0x80 };
 				break;
 
 				case SINGLE_COLOUR_RANDOM:
-					data[i].red = random_triplet[0];
-					data[i].green = random_triplet[1];
-					data[i].blue = random_triplet[2];
+					data[i] = (struct RGB){ .red = random_triplet[0], .green = random_triplet[1], .blue = random_triplet[2] };
 				break;
 			}
 		}
@@ -573,42 +942,32 @@ static uint8_t fill_single_colour(struct RGB *data, uint8_t num_leds, uint8_t st
  * 		struct RGB *  		LED data to write
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
- * 		void *count  		Counter for flashing version
+ * 		void *flash  		Non-zero for the flashing version
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-static uint8_t rainbow(struct RGB *data, uint8_t num_leds, uint8_t status, void *count)
+static uint8_t rainbow(struct RGB *data, uint8_t num_leds, uint8_t status, void *flash, uint16_t *wait)
 {
 
-	uint8_t *counter = (uint8_t *) count;
+	if (flash == NULL) {
 
-	if (status == PATTERN_STATUS_NEW) {
+		*wait = PATTERN_WAIT_FOREVER;
 
-		fill_rainbow_colours(data, num_leds);
-		status = PATTERN_STATUS_REFRESH;
-		if (counter != NULL) { 
-			*counter = 0;
+		if (status != PATTERN_STATUS_NEW) {
+			return PATTERN_STATUS_NOCHANGE;
 		}
 
 	} else {
 
-		if (counter != NULL) {
-
-			if ((*counter)++ == COLOUR_FLASH_COUNT) {
-				*counter = 0;
-				if (! intensity_halve(data, num_leds)) {
-					fill_rainbow_colours(data, num_leds);
-				}
-				
-				status = PATTERN_STATUS_REFRESH;
-			}
+		*wait = pattern_wait(COLOUR_FLASH_MS);
 
-		} else {
-			status = PATTERN_STATUS_NOCHANGE;
-		}
+	}
 
+	if (status == PATTERN_STATUS_NEW || ! intensity_halve(data, num_leds)) {
+		fill_rainbow_colours(data, num_leds);
 	}
 	
-	return status;
+	return PATTERN_STATUS_REFRESH;
 
 }
 
@@ -616,38 +975,43 @@ static uint8_t rainbow(struct RGB *data, uint8_t num_leds, uint8_t status, void
  * rainbow_wheel - version of rainbow that walks the leds
  *
  * Parameter
- * 		struct RGB *  		LED data to write
+ * 		struct RGB *  		Not used: shader pattern
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
- * 		void *count 		Running counter 
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-static uint8_t rainbow_wheel(struct RGB *data, uint8_t num_leds, uint8_t status, void *count)
+static uint8_t rainbow_wheel(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
 {
 
-	uint8_t *counter = (uint8_t *) count;
+	pattern_position = pattern_step(COLOUR_WALK_MS, num_leds / 3, wait) * 3;
+	
+	return PATTERN_STATUS_REFRESH;
 
-	if (status == PATTERN_STATUS_NEW) {
+}
 
-		*counter = 0;
-		fill_rainbow_colours(data, num_leds);
-		status = PATTERN_STATUS_REFRESH;
-
-	} else {
-
-		status = PATTERN_STATUS_NOCHANGE;
+/******************************************************************
+ * rainbow_wheel_shader - colour of one LED of rainbow_wheel
+ *
+ * Parameter
+ * 		uint8_t led			LED
+ * 		uint16_t time		Frame time
+ * 		void *unused
+ *
+ * The rainbow, turned pattern_position LEDs to the right
+ ******************************************************************/
 
-		if ((*counter)++ == COLOUR_WALK_COUNT) {
-			*counter = 0;
-			rotate_right(data, num_leds);
-			rotate_right(data, num_leds);
-			rotate_right(data, num_leds);
-			status = PATTERN_STATUS_REFRESH;
-		}
+static struct RGB rainbow_wheel_shader(uint8_t led, uint16_t time, void *unused)
+{
 
+	if (led >= pattern_position) {
+		led -= pattern_position;
+	} else {
+		led += NUM_LEDS - pattern_position;
 	}
-	
-	return status;
+
+	return rainbow_colour(led, NUM_LEDS);
 
 }
 
@@ -655,42 +1019,34 @@ static uint8_t rainbow_wheel(struct RGB *data, uint8_t num_leds, uint8_t status,
  * fade_colours - fade & flash colours
  *
  * Parameter
- * 		struct RGB *  		LED data to write
+ * 		struct RGB *  		Symmetric frame to write
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
  * 		void *fcp   		Extra params    
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-static uint8_t fade_colours(struct RGB *data, uint8_t num_leds, uint8_t status, void *fcp)
+static uint8_t fade_colours(struct RGB *data, uint8_t num_leds, uint8_t status, void *fcp, uint16_t *wait)
 {
 
 	struct colour_param *parameters = (struct colour_param *) fcp;
-	uint8_t *counter = parameters->counter;
 	uint8_t colour_type = parameters->colour_type;
+	struct symmetric_frame *frame = (struct symmetric_frame *) data;
 
-	if (status == PATTERN_STATUS_NEW) {
+	*wait = pattern_wait(COLOUR_FLASH_MS);
 
-		fill_colours(data, num_leds, colour_type);
-		status = PATTERN_STATUS_REFRESH;
-		*counter = 0;
+	if (status == PATTERN_STATUS_NEW) {
 
-	} else {
+		frame->map = symmetry_map_plain;
+		fill_colours(frame->sector, colour_type);
 
-			if ((*counter)++ == COLOUR_FLASH_COUNT) {
-				*counter = 0;
-				if (! intensity_halve(data, num_leds)) {
-					fill_colours(data, num_leds, colour_type);
-				}
-				
-				status = PATTERN_STATUS_REFRESH;
-			} else {
-				status = PATTERN_STATUS_NOCHANGE;	
-			}
+	} else if (! intensity_halve(frame->sector, ARM_LEDS)) {
 
+		fill_colours(frame->sector, colour_type);
 
 	}
 	
-	return status;
+	return PATTERN_STATUS_REFRESH;
 
 }
 
@@ -701,37 +1057,75 @@ static uint8_t fade_colours(struct RGB *data, uint8_t num_leds, uint8_t status,
  * 		struct RGB *  		LED data to write
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
- * 		void *count 		Running counter 
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-static uint8_t crazy(struct RGB *data, uint8_t num_leds, uint8_t status, void *count)
+static uint8_t crazy(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
 {
 
-	uint8_t *counter = (uint8_t *) count;
+	if (status == PATTERN_STATUS_NEW || ! intensity_halve(data, num_leds)) {
+		fill_single_colour(data, num_leds, PATTERN_STATUS_NEW, (void *) SINGLE_COLOUR_RANDOM, wait);
+	}
 
-	if (status == PATTERN_STATUS_NEW) {
+	*wait = pattern_wait(COLOUR_FLASH_MS);
+	
+	return PATTERN_STATUS_REFRESH;
 
-		fill_single_colour(data, num_leds, status, (void *) SINGLE_COLOUR_RANDOM);
-		status = PATTERN_STATUS_REFRESH;
-		*counter = 0;
+}
 
-	} else {
+/******************************************************************
+ * Walkers
+ *
+ * A walker is a bar of whole LEDs whose start is anywhere on the
+ * ring, in 8.8 fixed point. An LED is lit as much as the bar
+ * covers it, so a walker between two LEDs shares its light between
+ * them and glides round instead of jumping. Each LED is worked out
+ * from the position on its own, so the walkers are drawn by
+ * shaders and nothing is ever shifted round a buffer.
+ ******************************************************************/
 
-			if ((*counter)++ == COLOUR_FLASH_COUNT) {
-				*counter = 0;
-				if (! intensity_halve(data, num_leds)) {
-					fill_single_colour(data, num_leds, PATTERN_STATUS_NEW, (void *) SINGLE_COLOUR_RANDOM);
-				}
-				
-				status = PATTERN_STATUS_REFRESH;
-			} else {
-				status = PATTERN_STATUS_NOCHANGE;	
-			}
+#define RING_FIXED		((uint16_t) NUM_LEDS << 8)	// Ring length in 8.8 fixed point
+
+uint16_t walker_position = 0;	// Start of the walker, LEDs in 8.8 fixed point
+
+/******************************************************************
+ * walker_cover: how much of an LED a walker covers
+ *
+ * Parameter
+ * 		uint8_t led			LED
+ * 		uint16_t position	Start of the walker, LEDs in 8.8 fixed point
+ * 		uint8_t width		Length of the walker in LEDs
+ * Returns:
+ * 		uint16_t			Coverage in 256ths, 0 - 256
+ ******************************************************************/
+
+static uint16_t walker_cover(uint8_t led, uint16_t position, uint8_t width)
+{
 
+	// Distance from the walker to the LED, round the ring
+	uint16_t offset = ((uint16_t) led << 8) - position;
 
+	if (position >= RING_FIXED) {
+		offset += RING_FIXED;
 	}
-	
-	return status;
+
+	if ((int16_t) offset < 0) {
+		offset += RING_FIXED;
+	}
+
+	// LED starts on the walker
+	if (offset < ((uint16_t) width << 8)) {
+		offset = ((uint16_t) width << 8) - offset;
+		return (offset < 256) ? offset : 256;
+	}
+
+	// LED starts just before the walker
+	if (offset > RING_FIXED - 256) {
+		return offset + 256 - RING_FIXED;
+	}
+
+	return 0;
 
 }
 
@@ -739,49 +1133,62 @@ static uint8_t crazy(struct RGB *data, uint8_t num_leds, uint8_t status, void *c
  * walking_colour - walk two LEDs around
  *
  * Parameter
- * 		struct RGB *  		LED data to write
+ * 		struct RGB *  		Not used: shader pattern
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
  * 		void *fcp   		Extra params    
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * One LED every COLOUR_FLASH_MS
  ******************************************************************/
 
-static uint8_t walking_colour(struct RGB *data, uint8_t num_leds, uint8_t status, void *wcp)
+static uint8_t walking_colour(struct RGB *data, uint8_t num_leds, uint8_t status, void *wcp, uint16_t *wait)
 {
 
 	struct colour_param *parameters = (struct colour_param *) wcp;
-	uint8_t *counter = parameters->counter;
 	uint8_t colour_type = parameters->colour_type;
 
-	uint8_t triplets[4][3] = {
-		{127, 0, 0},
-		{0, 127, 0},
-		{0, 0, 127},
-		{random_byte(), random_byte(), random_byte()}
-	};
-
 	if (status == PATTERN_STATUS_NEW) {
 
-		data[0].red = data[10].red = triplets[colour_type][0];
-		data[0].green =  data[10].green =triplets[colour_type][1];
-		data[0].blue =  data[10].blue =triplets[colour_type][2];
+		uint8_t triplets[4][3] = {
+			{127, 0, 0},
+			{0, 127, 0},
+			{0, 0, 127},
+			{random_byte(), random_byte(), random_byte()}
+		};
 
-		status = PATTERN_STATUS_REFRESH;
-		*counter = 0;
+		pattern_colour = (struct RGB){ 
+			.red = triplets[colour_type][0],
+			.green = triplets[colour_type][1],
+			.blue = triplets[colour_type][2],
+		};
 
-	} else {
+	}
 
-			if ((*counter)++ == COLOUR_FLASH_COUNT) {
-				*counter = 0;
-			    rotate_right(data, num_leds);	
-				status = PATTERN_STATUS_REFRESH;
-			} else {
-				status = PATTERN_STATUS_NOCHANGE;	
-			}
+	walker_position = pattern_phase(COLOUR_FLASH_MS, num_leds, wait);
+	
+	return PATTERN_STATUS_REFRESH;
 
+}
 
-	}
-	
-	return status;
+/******************************************************************
+ * walking_colour_shader - colour of one LED of walking_colour
+ *
+ * Parameter
+ * 		uint8_t led			LED
+ * 		uint16_t time		Frame time
+ * 		void *fcp   		Extra params    
+ *
+ * Two walkers of one LED, 10 LEDs apart
+ ******************************************************************/
+
+static struct RGB walking_colour_shader(uint8_t led, uint16_t time, void *wcp)
+{
+
+	uint16_t cover = walker_cover(led, walker_position, 1) +
+		walker_cover(led, walker_position + (10 << 8), 1);
+
+	return scale_colour(pattern_colour, cover);
 
 }
 
@@ -789,142 +1196,117 @@ static uint8_t walking_colour(struct RGB *data, uint8_t num_leds, uint8_t status
  * walking_bar - walk a 4-LED bar around
  *
  * Parameter
- * 		struct RGB *  		LED data to write
+ * 		struct RGB *  		Not used: shader pattern
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
  * 		void *fcp   		Extra params    
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * Three LEDs every COLOUR_FLASH_MS
  ******************************************************************/
 
-static uint8_t walking_bar(struct RGB *data, uint8_t num_leds, uint8_t status, void *wcp)
+static uint8_t walking_bar(struct RGB *data, uint8_t num_leds, uint8_t status, void *wcp, uint16_t *wait)
 {
 
 	struct colour_param *parameters = (struct colour_param *) wcp;
-	uint8_t *counter = parameters->counter;
 	uint8_t colour_type = parameters->colour_type;
 
-	uint8_t triplets[4][3] = {
-		{127, 0, 0},
-		{0, 127, 0},
-		{0, 0, 127},
-		{random_byte(), random_byte(), random_byte()}
-	};
-
 	if (status == PATTERN_STATUS_NEW) {
 
-		data[0].red = data[9].red = triplets[colour_type][0];
-		data[1].red = data[10].red = triplets[colour_type][0];
-		data[0].green =  data[9].green =triplets[colour_type][1];
-		data[1].green =  data[10].green =triplets[colour_type][1];
-		data[0].blue =  data[9].blue =triplets[colour_type][2];
-		data[1].blue =  data[10].blue =triplets[colour_type][2];
-
-		status = PATTERN_STATUS_REFRESH;
-		*counter = 0;
-
-	} else {
-
-			if ((*counter)++ == COLOUR_FLASH_COUNT) {
-				*counter = 0;
-			    rotate_right(data, num_leds);	
-			    rotate_right(data, num_leds);	
-			    rotate_right(data, num_leds);	
-				status = PATTERN_STATUS_REFRESH;
-			} else {
-				status = PATTERN_STATUS_NOCHANGE;	
-			}
+		uint8_t triplets[4][3] = {
+			{127, 0, 0},
+			{0, 127, 0},
+			{0, 0, 127},
+			{random_byte(), random_byte(), random_byte()}
+		};
 
+		pattern_colour = (struct RGB){ 
+			.red = triplets[colour_type][0],
+			.green = triplets[colour_type][1],
+			.blue = triplets[colour_type][2],
+		};
 
 	}
+
+	walker_position = pattern_phase(COLOUR_FLASH_MS, num_leds / 3, wait) * 3;
 	
-	return status;
+	return PATTERN_STATUS_REFRESH;
 
 }
 
 /******************************************************************
- * trilobe - divide in three parts and walk those around
+ * walking_bar_shader - colour of one LED of walking_bar
  *
  * Parameter
- * 		struct RGB *  		LED data to write
- * 		uint8_t num_leds	Number of LEDs
- * 		uint8_t	status		Status of pattern
- * 		void *tcp			Extra params
+ * 		uint8_t led			LED
+ * 		uint16_t time		Frame time
+ * 		void *fcp   		Extra params    
+ *
+ * Two walkers of two LEDs, on opposite sides of the ring
  ******************************************************************/
 
-static uint8_t trilobe(struct RGB *data, uint8_t num_leds, uint8_t status, void *tcp)
+static struct RGB walking_bar_shader(uint8_t led, uint16_t time, void *wcp)
 {
 
-	struct trilobe_param *parameters = (struct trilobe_param *) tcp;
-	uint8_t *counter = parameters->counter;
-	uint8_t *state = parameters->state;
-
-	uint8_t bit = 0;
-
-	// Remember that struct RGB is GRB in memory
-	struct RGB orange = { 0x30, 0x80, 0x00};
-	struct RGB blue = { 0x00, 0x00, 0x80};
-	struct RGB red = { 0x00, 0x80, 0x00};
-	struct RGB blank = { 0x00, 0x00, 0x00};
-
-	struct fill_funcs_t {
-    	void (*fill_function) (struct RGB *, uint8_t, uint8_t, struct RGB);
-		uint8_t start;
-		uint8_t end;
-		struct RGB colour;
-	};
-
-	struct fill_funcs_t fill_funcs[3] = {
-		{fill_range_colour, 12, 17, red},
-		{fill_range_colour, 6, 11, blue},
-		{fill_range_colour, 0, 5, orange},
-	};
-	
-	struct fill_funcs_t ff;
-
-	if (status == PATTERN_STATUS_NEW) {
-
-		ff = fill_funcs[2];
-		ff.fill_function(data, ff.start, ff.end, ff.colour);
-		
-		*counter = 0;
-		*state = TRILOBE_INITIAL_STATE;
-
-		status = PATTERN_STATUS_REFRESH;
-
-	} else {
+	uint16_t cover = walker_cover(led, walker_position, 2) +
+		walker_cover(led, walker_position + (NUM_LEDS / 2 << 8), 2);
 
-			if ((*counter)++ == COLOUR_WALK_COUNT) {
+	return scale_colour(pattern_colour, cover);
 
-				*counter = 0;
+}
 
-				*state >>= 1;
+/******************************************************************
+ * trilobe - divide in three parts and walk those around
+ *
+ * Parameter
+ * 		struct RGB *  		Indexed frame to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * Every lobe has its own palette entry, so the keyframes are
+ * just the three palette entries.
+ ******************************************************************/
 
-				for (bit = 0; bit < 3; bit++) {
+static struct RGB trilobe_key(uint8_t lobe, uint8_t key)
+{
 
-					ff = fill_funcs[bit];
+	// Named members: the order of struct RGB in memory depends on WS2812_ORDER
+	static const struct RGB colours[3] = {
+		{ .red = 0x80 },
+		{ .blue = 0x80 },
+		{ .green = 0x30, .red = 0x80 },
+	};
 
-					if (IS_BIT_SET(*state, bit)) {
-						ff.fill_function(data, ff.start, ff.end, ff.colour);
-					} else {
-						ff.fill_function(data, ff.start, ff.end, blank);
-					}
+	// Lobes light up one by one and go out again over 6 keys
+	uint8_t state = (TRILOBE_INITIAL_STATE >> 1) >> key;
 
-				}
+	if (IS_BIT_SET(state, lobe)) {
+		return colours[lobe];
+	}
 
-				if (*state == 0) 
-					*state = TRILOBE_INITIAL_STATE;
-				
-				status = PATTERN_STATUS_REFRESH;
+	return (struct RGB){ 0 };
 
-			} else {
+}
 
-				status = PATTERN_STATUS_NOCHANGE;	
+static const struct keyframes trilobe_keys = { trilobe_key, 6, COLOUR_WALK_MS };
 
-			}
+static uint8_t trilobe(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
 
+	struct indexed_frame *frame = (struct indexed_frame *) data;
 
+	if (status == PATTERN_STATUS_NEW) {
+		fill_range_index(frame->index, 12, 17, 0);
+		fill_range_index(frame->index, 6, 11, 1);
+		fill_range_index(frame->index, 0, 5, 2);
 	}
+
+	keyframe_time(&trilobe_keys, wait);
+	keyframe_fill(&trilobe_keys, frame->palette, 3);
 	
-	return status;
+	return PATTERN_STATUS_REFRESH;
 
 }
 
@@ -932,352 +1314,2168 @@ static uint8_t trilobe(struct RGB *data, uint8_t num_leds, uint8_t status, void
  * tricircle - Circle moving outwards in three steps
  *
  * Parameter
- * 		struct RGB *  		LED data to write
+ * 		struct RGB *  		Symmetric frame to write
  * 		uint8_t num_leds	Number of LEDs
  * 		uint8_t	status		Status of pattern
  * 		void *tccp			Extra params
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * The circles are the outer, middle and inner LED of every arm,
+ * so the keyframes are just the three sector colours.
  ******************************************************************/
 
-static uint8_t tricircle(struct RGB *data, uint8_t num_leds, uint8_t status, void *tcp)
+static struct RGB tricircle_key(uint8_t circle, uint8_t key)
 {
 
-	struct tricircle_param *parameters = (struct tricircle_param *) tcp;
-	uint8_t *counter = parameters->counter;
-	uint8_t *state = parameters->state;
+	// Inner, middle, outer circle and a dark key
+	uint8_t state = (TRICIRCLE_INITIAL_STATE >> 1) >> key;
 
-	uint8_t bit = 0;
+	if (IS_BIT_SET(state, circle)) {
+		return pattern_colour;
+	}
 
-	struct RGB colour = get_colour_from_parameter(parameters->colour_type);
-	struct RGB blank = { 0x00, 0x00, 0x00};
+	return (struct RGB){ 0 };
 
-	struct fill_funcs_t {
-    	void (*fill_function) (struct RGB *, uint8_t , uint8_t *, struct RGB);
-		uint8_t num_leds;
-		uint8_t *leds;
-		struct RGB colour;
-	};
+}
 
-	uint8_t inner_circle[6] = {2, 5, 8, 11, 14, 17};
-	uint8_t middle_circle[6] = {1, 3, 6, 9, 12, 15};
-	uint8_t outer_circle[6] = {0, 4, 7, 10, 13, 16};
+static const struct keyframes tricircle_keys = { tricircle_key, 4, COLOUR_WALK_MS };
 
-	struct fill_funcs_t fill_funcs[3] = {
-		{fill_some_colour, 6, outer_circle, colour},
-		{fill_some_colour, 6, middle_circle, colour},
-		{fill_some_colour, 6, inner_circle, colour},
-	};
-	
-	struct fill_funcs_t ff;
+static uint8_t tricircle(struct RGB *data, uint8_t num_leds, uint8_t status, void *tcp, uint16_t *wait)
+{
+
+	struct tricircle_param *parameters = (struct tricircle_param *) tcp;
+	struct symmetric_frame *frame = (struct symmetric_frame *) data;
 
 	if (status == PATTERN_STATUS_NEW) {
+		frame->map = symmetry_map_plain;
+		pattern_colour = get_colour_from_parameter(parameters->colour_type);
+	}
 
-		ff = fill_funcs[2];
-		ff.fill_function(data, ff.num_leds, ff.leds, ff.colour);
-		
-		*counter = 0;
-		*state = TRICIRCLE_INITIAL_STATE;
+	keyframe_time(&tricircle_keys, wait);
+	keyframe_fill(&tricircle_keys, frame->sector, ARM_LEDS);
+	
+	return PATTERN_STATUS_REFRESH;
 
-		status = PATTERN_STATUS_REFRESH;
+}
 
-	} else {
+/******************************************************************
+ * kaleidoscope - rainbow sector in changing symmetries
+ *
+ * Parameter
+ * 		struct RGB *  		Symmetric frame to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * The sector walks through the rainbow, and every time it has
+ * gone round once the next symmetry map is used.
+ ******************************************************************/
 
-			if ((*counter)++ == COLOUR_WALK_COUNT) {
+static uint8_t kaleidoscope(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
 
-				*counter = 0;
+	struct symmetric_frame *frame = (struct symmetric_frame *) data;
 
-				*state >>= 1;
+	uint8_t i;
 
-				for (bit = 0; bit < 3; bit++) {
+	pattern_position = pattern_step(COLOUR_WALK_MS, NUM_LEDS * NUM_SYMMETRY_MAPS, wait);
 
-					ff = fill_funcs[bit];
+	frame->map = (const uint8_t *) pgm_read_word(&symmetry_maps[pattern_position / NUM_LEDS]);
 
-					if (IS_BIT_SET(*state, bit)) {
-						ff.fill_function(data, ff.num_leds, ff.leds, ff.colour);
-					} else {
-						ff.fill_function(data, ff.num_leds, ff.leds, blank);
-					}
+	for (i = 0; i < ARM_LEDS; i++) {
+		frame->sector[i] = rainbow_colour(pattern_position + i * 2, NUM_LEDS);
+	}
 
-				}
+	return PATTERN_STATUS_REFRESH;
 
-				if (*state == 0) 
-					*state = TRICIRCLE_INITIAL_STATE;
-				
-				status = PATTERN_STATUS_REFRESH;
+}
 
-			} else {
+/******************************************************************
+ * Particles
+ *
+ * A fixed pool of NUM_PARTICLES particles, of which the first
+ * num_live are alive. A particle is added to the frame buffer, and
+ * taken off again before it moves or fades, so the frame buffer
+ * is never cleared or redrawn as a whole, and the cost of a frame
+ * goes by the live particles, whatever the number of LEDs. Where
+ * particles overlap and saturate an LED, taking one off leaves
+ * the LED a little darker until the others are gone too.
+ *
+ * Cycles, counted by hand from the code: a live particle costs
+ * about 460 a frame sparkling (two particle_colour calls of about
+ * 175, with three scale8 each, and the adding and subtracting),
+ * and about 650 falling, which looks up its LED twice with a
+ * division by 86. A particle lives 32 frames, and the patterns
+ * start one in 6 and 4 of 64 frames (spawn, against random_byte,
+ * which is 0 - 63), so 3 and 2 are alive on average (about 1400
+ * and 1300 cycles) and more than 8 hardly ever. A full pool, as
+ * the worst case:
+ *
+ *	NUM_PARTICLES	sparkle		snowfall	RAM
+ *	8				3700		5200		24 bytes
+ *	16				7400		10400		48 bytes
+ *	32				14700		20800		96 bytes
+ *
+ * Even 20800 cycles is only 1ms of the 16ms frame at 20MHz. These
+ * are not measurements: the table has not been filled in from an
+ * ATtiny85 yet. Build with -DPARTICLES_PROFILE and NUM_PARTICLES
+ * 8, 16 or 32 to measure it: the frame is timed with task_ticks
+ * (256 cycle steps), and the longest update is kept in
+ * particles_max_cycles.
+ ******************************************************************/
 
-				status = PATTERN_STATUS_NOCHANGE;	
+struct particle {
+	uint8_t led;		// LED, or first LED of the arm for falling particles
+	uint8_t life;		// Brightness left, counts down to 0
+	uint8_t colour;		// Index in particle_colours
+};
 
-			}
+struct particle particle_pool[NUM_PARTICLES];
+uint8_t num_live = 0;
 
+#ifdef PARTICLES_PROFILE
+volatile uint16_t particles_max_cycles = 0;
 
-	}
-	
-	return status;
+static uint16_t get_ms_clock(void);
+#endif
 
-}
+// Snow colours. Named members: the order of struct RGB in memory depends on WS2812_ORDER
+#define NUM_PARTICLE_COLOURS	4
 
+static const struct RGB particle_colours[NUM_PARTICLE_COLOURS] PROGMEM = {
+	{ .red = 96, .green = 96, .blue = 96 },
+	{ .red = 32, .green = 64, .blue = 128 },
+	{ .red = 48, .green = 112, .blue = 112 },
+	{ .red = 80, .green = 64, .blue = 112 },
+};
 
 /******************************************************************
- * init_IO: initialise I/O pins
+ * particle_led: LED a particle is on
+ *
+ * Parameter
+ * 		struct particle *	Particle
+ * 		uint8_t fall		Particle falls along its arm
+ * Returns:
+ * 		uint8_t				LED
+ *
+ * A falling particle goes from the outer to the inner LED of its
+ * arm over its life.
  ******************************************************************/
 
-static void init_IO(void)
+static uint8_t particle_led(struct particle *particle, uint8_t fall)
 {
 
-	DDRB = 0b00000001;	// All input except PB0
-    PORTB = 0b11111110; // All pullup, PB0 low
+	uint8_t ring;
+	uint8_t led;
+
+	if (!fall) {
+		return particle->led;
+	}
+
+	ring = (uint8_t) (255 - particle->life) / 86;
+
+	for (led = particle->led; led < particle->led + ARM_LEDS - 1; led++) {
+		if (pgm_read_byte(&symmetry_map_plain[led]) == ring) {
+			break;
+		}
+	}
+
+	return led;
 
 }
 
 /******************************************************************
- * init_debounce_timer: initialise Timer0 for debouncing
+ * particle_colour: colour a particle is drawn in now
  *
- * Timer0 runs in CTC mode with a /1024 prescaler and counts to 200
- * This results in ISR every 10ms, which will be used to debounce
+ * Parameter
+ * 		struct particle *	Particle
+ * Returns:
+ * 		struct RGB			colour
  ******************************************************************/
 
-static void init_debounce_timer(void) 
+static struct RGB particle_colour(struct particle *particle)
 {
 
-	// CTC mode
-	TCCR0A &= ~(1 << WGM00);
-	TCCR0A |= (1 << WGM01);
-	TCCR0B &= ~(1 << WGM02);
-
-	// Count to 200
-	OCR0A = 200;
+	struct RGB colour;
 
-	// Enable Compare Match interrupt
-	TIMSK |= (1 << OCIE0A);
+	memcpy_P(&colour, &particle_colours[particle->colour], sizeof(struct RGB));
 
-	// Start timer with prescaler /1024
-	TCCR0B |= (1 << CS02 | 1 << CS00);
-	TCCR0B &= ~(1 << CS01);
+	return scale_colour(colour, particle->life);
 
 }
 
 /******************************************************************
- * Timer0 compare match interrupt: debounce button press
+ * particles - snow sparkling or falling
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *pp			Extra params
+ * 		uint16_t *wait		Returns the time until the next change
  ******************************************************************/
 
-volatile uint8_t short_press = 0;
-volatile uint8_t isr_short_press = 0;
-volatile uint8_t long_press = 0;
-volatile uint8_t next_pattern = 0;
-volatile uint8_t demo_mode = 0;
-volatile uint8_t current_debounce_count = 0;
-volatile uint8_t button_press_acknowledged = 1;
-volatile uint16_t demo_time_counter = 0;
-
-ISR(TIM0_COMPA_vect)
+static uint8_t particles(struct RGB *data, uint8_t num_leds, uint8_t status, void *pp, uint16_t *wait)
 {
 
-	if (button_press_acknowledged) {
+	struct particle_param *parameters = (struct particle_param *) pp;
+	struct particle *particle;
+	uint8_t i = 0;
 
-		switch (current_debounce_count) {
+#ifdef PARTICLES_PROFILE
+	uint16_t start = task_ticks(get_ms_clock);
+#endif
 
-			case 0:
-				if (bit_is_clear(PINB,BUTTON)) {
-					current_debounce_count = 1;
-				}
-				break;
+	if (status == PATTERN_STATUS_NEW) {
+		memset(data, 0, num_leds * sizeof(struct RGB));
+		num_live = 0;
+	}
 
-			case DEBOUNCE_COUNT_SHORT:
-				if (bit_is_clear(PINB,BUTTON)) {
-					// Press detected
-					isr_short_press = 1;
-				}
-				current_debounce_count++;
-				break;
+	while (i < num_live) {
 
-			case DEBOUNCE_COUNT_MID:
-				if (isr_short_press && bit_is_set(PINB,BUTTON)) {
-					// Button no longer pressed: it's a short
-					short_press = 1;
-					button_press_acknowledged = 0;
-					current_debounce_count = 0;	
-					isr_short_press = 0;
-				} else {
-					// Button still pressed - wait for a long press
-					current_debounce_count++;
-				}
-				break;
+		particle = &particle_pool[i];
 
-			// If we get to this case, the button has been pressed and was still
-			// pressed at DEBOUNCE_COUNT_MID. So it is (probably) not two short
-			// presses DEBOUNCE_COUNT_LONG apart
-			case DEBOUNCE_COUNT_LONG:
-				if (bit_is_clear(PINB,BUTTON)) {
-					// It's a long press
-					long_press = 1;
-					button_press_acknowledged = 0;
-				} else if (isr_short_press) {
-					// It was a short press after all
-					short_press = 1;
-					button_press_acknowledged = 0;
-				}
-				current_debounce_count = 0;
-				isr_short_press = 0;
-				break;
+		subtract_colour(&data[particle_led(particle, parameters->fall)], particle_colour(particle));
 
-			default:	// 1 to DEBOUNCE_COUNT_LONG-1
-				current_debounce_count++;
-				break;
-			
-				
+		if (particle->life <= PARTICLE_FADE) {
+			// Dead: the last live particle takes its place
+			*particle = particle_pool[--num_live];
+			continue;
 		}
+
+		particle->life -= PARTICLE_FADE;
+		add_colour(&data[particle_led(particle, parameters->fall)], particle_colour(particle));
+		i++;
+
 	}
 
-	if (demo_mode) {
-	
-		if(++demo_time_counter == DEMO_TIME_COUNT) {
-			demo_time_counter = 0;
-			next_pattern = 1;
+	if (num_live < NUM_PARTICLES && random_byte() < parameters->spawn) {
+
+		particle = &particle_pool[num_live++];
+		particle->led = random_byte() % num_leds;
+		if (parameters->fall) {
+			particle->led -= particle->led % ARM_LEDS;
 		}
+		particle->life = 0xff;
+		particle->colour = random_byte() % NUM_PARTICLE_COLOURS;
+		add_colour(&data[particle_led(particle, parameters->fall)], particle_colour(particle));
+
+	}
 
+#ifdef PARTICLES_PROFILE
+	uint16_t cycles = (task_ticks(get_ms_clock) - start) * 256;
+	if (cycles > particles_max_cycles) {
+		particles_max_cycles = cycles;
 	}
+#endif
+
+	*wait = FRAME_MS;
+	
+	return PATTERN_STATUS_REFRESH;
 
 }
 
 /******************************************************************
- * copy_buffer: copy struct RGB
- * 
- * Parameters:
+ * Animation
+ *
+ * Plays back frames drawn on a PC, from a table in flash made by
+ * tools/encode_animation.py (see animation.csv). Each frame is
+ * stored as its changes to the frame before, decoded straight
+ * into the frame buffer:
+ *
+ *	hold		ANIMATION_TICK_MS units to show the frame, 0 ends
+ *				the animation
+ *	ops			until ANIMATION_END_FRAME:
+ *		00nnnnnn	skip n LEDs, they stay as they are
+ *		01nnnnnn	n + 1 LEDs of the colour in the next 3 bytes
+ *		10nnnnnn	n + 1 LEDs, each with its own 3 colour bytes
+ *
+ * Colours are stored as red, green, blue, whatever WS2812_ORDER
+ * is. The first frame has no skips, so the animation can loop.
  *
- * 		struct RGB *source
- * 		struct RGB *dest
- *		uint8_t	size
+ * A frame costs about 30 cycles per op and 20 per LED written.
+ * Build with -DANIMATION_PROFILE to measure it on the target:
+ * Timer1 then runs at CK/8 and the longest frame is kept in
+ * animation_max_cycles.
  ******************************************************************/
 
-static void copy_buffer(struct RGB *source, struct RGB *dest, uint8_t size)
-{
+#define ANIMATION_TICK_MS		16
 
-	uint16_t i; 
+#define ANIMATION_END_FRAME		0x00
+#define ANIMATION_OP_MASK		0xc0
+#define ANIMATION_OP_SKIP		0x00
+#define ANIMATION_OP_RUN		0x40
+#define ANIMATION_OP_LITERAL	0x80
+#define ANIMATION_COUNT_MASK	0x3f
 
-	for (i = 0 ; i < size*3 ; i++) {
-		*dest++ = *source++;
-	}
+const uint8_t *animation_position;
 
-}
+#ifdef ANIMATION_PROFILE
+volatile uint16_t animation_max_cycles = 0;
+#endif
 
 /******************************************************************
- * quick_flash_leds: quickly flash all leds 
- * 
- * Parameters:
+ * animation_colour: read a colour from the animation
  *
- *		struct RGB *data	
- *		static uint8_t num_leds
+ * Returns:
+ * 		struct RGB		colour
  ******************************************************************/
 
-static void quick_flash_leds(struct RGB* data, uint8_t num_leds) 
+static struct RGB animation_colour(void)
 {
 
-	uint8_t flash_count = 0;
-
-	struct RGB *buffer = malloc(sizeof(struct RGB) * NUM_LEDS);
+	struct RGB colour = {
+		.red = pgm_read_byte(animation_position),
+		.green = pgm_read_byte(animation_position + 1),
+		.blue = pgm_read_byte(animation_position + 2),
+	};
 
-	copy_buffer(data, buffer, NUM_LEDS);
+	animation_position += 3;
 
-	for (flash_count = 0; flash_count < NUM_QUICK_FLASH; flash_count++) {
-		while(intensity_halve(buffer, num_leds)) {
-			send_frame(buffer, num_leds, LED_PIN);
-			_delay_ms(QUICK_FLASH_DELAY);
-		}
+	return colour;
 
-		copy_buffer(data, buffer, NUM_LEDS);
-		send_frame(buffer, num_leds, LED_PIN);
-		_delay_ms(QUICK_FLASH_DELAY);
-	}
+}
 
-	// Restore original pattern
-	send_frame(data, num_leds, LED_PIN);
+/******************************************************************
+ * animation - play back frames from flash
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *ap			Animation table (in PROGMEM)
+ * 		uint16_t *wait		Returns the time until the next change
+ ******************************************************************/
+
+static uint8_t animation(struct RGB *data, uint8_t num_leds, uint8_t status, void *ap, uint16_t *wait)
+{
+
+	const uint8_t *start = (const uint8_t *) ap;
+	struct RGB colour;
+	uint8_t hold;
+	uint8_t op;
+	uint8_t count;
+	uint8_t led = 0;
+
+#ifdef ANIMATION_PROFILE
+	TCCR1 = (1 << CS12);	// CK/8
+	uint8_t begin = TCNT1;
+#endif
+
+	if (status == PATTERN_STATUS_NEW) {
+		memset(data, 0, num_leds * sizeof(struct RGB));
+		animation_position = start;
+	}
+
+	hold = pgm_read_byte(animation_position++);
+
+	if (hold == 0) {
+		animation_position = start;
+		hold = pgm_read_byte(animation_position++);
+	}
+
+	while ((op = pgm_read_byte(animation_position++)) != ANIMATION_END_FRAME) {
+
+		count = op & ANIMATION_COUNT_MASK;
+
+		switch (op & ANIMATION_OP_MASK) {
+
+		case ANIMATION_OP_SKIP:
+			led += count;
+			break;
+
+		case ANIMATION_OP_RUN:
+			colour = animation_colour();
+			do {
+				if (led < num_leds) {
+					data[led] = colour;
+				}
+				led++;
+			} while (count--);
+			break;
+
+		default:
+			do {
+				colour = animation_colour();
+				if (led < num_leds) {
+					data[led] = colour;
+				}
+				led++;
+			} while (count--);
+			break;
+
+		}
+
+	}
+
+#ifdef ANIMATION_PROFILE
+	uint16_t cycles = (uint8_t) (TCNT1 - begin) * 8;
+	if (cycles > animation_max_cycles) {
+		animation_max_cycles = cycles;
+	}
+#endif
+
+	*wait = hold * ANIMATION_TICK_MS;
+
+	return PATTERN_STATUS_REFRESH;
+
+}
+
+/******************************************************************
+ * Value noise
+ *
+ * A smooth random field in three dimensions: two for the position
+ * of an LED on the snowflake, one for time. The field has a random
+ * value at every whole lattice point (from a permutation table in
+ * flash) and is interpolated in between, so nearby LEDs and
+ * nearby moments get similar values.
+ *
+ * Coordinates are 8.8 fixed point: the high byte is the lattice
+ * cell, the low byte the position within it. The snowflake is
+ * about two cells across, and the field repeats every 256 cells.
+ *
+ * No multiplies: a sample is 8 hashes (three table reads each),
+ * 3 fades and 7 lerps, one scale8 each, about 500 cycles. By hand
+ * count, for all 18 LEDs:
+ *
+ *	frost	1 sample per LED	about 9000 cycles, 0.45ms
+ *	aurora	2 samples per LED	about 18000 cycles, 0.9ms
+ *			and scale_colour
+ *
+ * so a frame every FRAME_MS (60 per second) costs 3% of the CPU
+ * for frost and 6% for aurora. Build with -DNOISE_PROFILE to
+ * measure a frame on the target: it is timed with task_ticks
+ * (256 cycle steps, so an 8 bit count of a prescaled timer does
+ * not wrap on aurora), and the longest frame is kept in
+ * noise_max_cycles.
+ ******************************************************************/
+
+static const uint8_t noise_permutation[256] PROGMEM = {
+	171,  74, 182, 220, 172, 107, 148, 135, 164, 121, 134,  97, 196, 195,  14, 103,
+	221, 143,  59, 168, 128,   1, 200,  54, 112,  61, 179, 159, 210, 161, 169, 249,
+	142, 177, 181, 239,  45, 238, 108,   5,  39, 226, 209,  55,  48,  13, 173,  44,
+	149, 105,  91, 167, 225, 194,  10,  19, 254, 199, 144, 234, 241, 127,  24,  65,
+	111,  22, 176, 115,  88,   8,   6, 223,   4,  64, 122,  23,  18,   9, 229,  69,
+	201,  49,  66, 147,   3, 138, 233,  63, 247,  47, 151, 154, 211, 187, 116,  82,
+	193,  26,  31,  34,  28,  46, 185, 165,  32,  56, 235,  38, 104, 186, 110, 253,
+	 27, 101,  96, 163,  12, 198,  70,  51,  71, 158,  35, 251, 188, 114, 184, 124,
+	  0,  21,  99,  83,  30, 170, 218, 100, 232, 191, 236, 192,  52,  86, 212, 246,
+	 25, 215,  20,  11, 146,  85, 180,  42, 189,  90, 174, 178,  36,  89, 219, 136,
+	243, 214,  79,  72, 137, 157,  29, 153,  75, 145,  16, 183,  68, 130,   2,  43,
+	213, 204,  40,  37, 242, 250, 227, 252,  41, 106,  80, 120, 224, 113, 217, 129,
+	230, 216, 248, 240, 162, 190,  93, 150, 140, 202, 133, 102,  50,  67,  95, 123,
+	205, 245, 141,  62, 175, 119,  15, 166, 132,  73,  81,  87,  58,  78, 155,  84,
+	207, 197, 109, 125, 126,  33, 231, 139,  57,  76, 156,  60, 228, 203,  17, 244,
+	 53, 160, 237, 222, 117, 118,  77, 255, 152,  98,   7, 131, 208,  94,  92, 206,
+};
+
+// Where each LED is, in noise coordinates, in wiring order
+static const uint16_t led_position[NUM_LEDS][2] PROGMEM = {
+	{ 384, 624 },	{ 384, 544 },	{ 384, 464 },
+	{ 245, 464 },	{ 176, 504 },	{ 315, 424 },
+	{ 245, 304 },	{ 176, 264 },	{ 315, 344 },
+	{ 384, 224 },	{ 384, 144 },	{ 384, 304 },
+	{ 523, 304 },	{ 592, 264 },	{ 453, 344 },
+	{ 523, 464 },	{ 592, 504 },	{ 453, 424 },
+};
+
+uint16_t noise_z = 0;			// Time coordinate
+uint8_t noise_z_rest = 0;		// ms not yet added to noise_z
+uint16_t noise_last = 0;		// frame_time of the last frame
+
+#ifdef NOISE_PROFILE
+volatile uint16_t noise_max_cycles = 0;
+
+static uint16_t get_ms_clock(void);
+#endif
+
+static uint8_t noise_hash(uint8_t x, uint8_t y, uint8_t z)
+{
+
+	uint8_t hash = pgm_read_byte(&noise_permutation[x]);
+
+	hash = pgm_read_byte(&noise_permutation[(uint8_t) (hash + y)]);
+
+	return pgm_read_byte(&noise_permutation[(uint8_t) (hash + z)]);
+
+}
+
+/******************************************************************
+ * noise_fade: ease a position within a cell
+ *
+ * Parameters:
+ *		uint8_t t		position, 0 - 255
+ *
+ * Returns:
+ *		uint8_t			eased position
+ *
+ * Two parabolas meeting in the middle, flat at both ends, so the
+ * field has no creases at the cell borders.
+ ******************************************************************/
+
+static uint8_t noise_fade(uint8_t t)
+{
+
+	if (t & 0x80) {
+		return 0xff - (scale8(~t, ~t) << 1);
+	}
+
+	return scale8(t, t) << 1;
+
+}
+
+/******************************************************************
+ * noise3: sample the field
+ *
+ * Parameters:
+ *		uint16_t x, y, z	8.8 coordinates
+ *
+ * Returns:
+ *		uint8_t				value, 0 - 255
+ ******************************************************************/
+
+static uint8_t noise3(uint16_t x, uint16_t y, uint16_t z)
+{
+
+	uint8_t xi = x >> 8, yi = y >> 8, zi = z >> 8;
+	uint8_t u = noise_fade(x), v = noise_fade(y), w = noise_fade(z);
+	uint8_t near, far;
+
+	near = lerp8(lerp8(noise_hash(xi, yi, zi), noise_hash(xi + 1, yi, zi), u),
+			lerp8(noise_hash(xi, yi + 1, zi), noise_hash(xi + 1, yi + 1, zi), u), v);
+	far = lerp8(lerp8(noise_hash(xi, yi, zi + 1), noise_hash(xi + 1, yi, zi + 1), u),
+			lerp8(noise_hash(xi, yi + 1, zi + 1), noise_hash(xi + 1, yi + 1, zi + 1), u), v);
+
+	return lerp8(near, far, w);
+
+}
+
+/******************************************************************
+ * noise_advance: move the time coordinate on
+ *
+ * Parameters:
+ *		uint8_t status		Status of pattern
+ *		uint8_t shift		Speed: one cell per 256 << shift ms
+ *
+ * Goes by frame_time, so the speed does not depend on the frame
+ * rate, and never jumps when the ms clock wraps.
+ ******************************************************************/
+
+static void noise_advance(uint8_t status, uint8_t shift)
+{
+
+	uint16_t elapsed;
+
+	if (status == PATTERN_STATUS_NEW) {
+		noise_last = frame_time;
+	}
+
+	elapsed = frame_time - noise_last + noise_z_rest;
+	noise_last = frame_time;
+
+	noise_z += elapsed >> shift;
+	noise_z_rest = elapsed & ((1 << shift) - 1);
+
+}
+
+/******************************************************************
+ * Frost shimmer - icy glints coming and going
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * Only the top half of the field lights up, stretched to full
+ * brightness, so most LEDs are dark at any time.
+ ******************************************************************/
+
+static uint8_t frost(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
+
+	uint8_t i;
+	uint8_t value;
+
+#ifdef NOISE_PROFILE
+	uint16_t start = task_ticks(get_ms_clock);
+#endif
+
+	noise_advance(status, 0);
+
+	for (i = 0; i < num_leds; i++) {
+
+		value = noise3(pgm_read_word(&led_position[i][0]) << 1, pgm_read_word(&led_position[i][1]) << 1, noise_z);
+		value = (value & 0x80) ? (value << 1) : 0;
+
+		data[i] = (struct RGB){
+			.red = value >> 2,
+			.green = value >> 1,
+			.blue = value >> 1,
+		};
+
+	}
+
+#ifdef NOISE_PROFILE
+	uint16_t cycles = (task_ticks(get_ms_clock) - start) * 256;
+	if (cycles > noise_max_cycles) {
+		noise_max_cycles = cycles;
+	}
+#endif
+
+	*wait = FRAME_MS;
+
+	return PATTERN_STATUS_REFRESH;
+
+}
+
+/******************************************************************
+ * Aurora - slow curtains of green and violet
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * One sample picks the colour between green and violet, a second
+ * one, further along the field, the brightness.
+ ******************************************************************/
+
+static uint8_t aurora(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
+
+	uint8_t i;
+	uint16_t x, y;
+	uint8_t hue;
+	uint8_t brightness;
+
+#ifdef NOISE_PROFILE
+	uint16_t start = task_ticks(get_ms_clock);
+#endif
+
+	noise_advance(status, 3);
+
+	for (i = 0; i < num_leds; i++) {
+
+		x = pgm_read_word(&led_position[i][0]);
+		y = pgm_read_word(&led_position[i][1]);
+
+		hue = noise3(x, y + noise_z, noise_z);
+		brightness = noise3(x + 0x1000, y, noise_z >> 1);
+
+		data[i] = scale_colour((struct RGB){
+			.red = lerp8(0, 0x60, hue),
+			.green = lerp8(0xa0, 0, hue),
+			.blue = lerp8(0x30, 0xa0, hue),
+		}, brightness);
+
+	}
+
+#ifdef NOISE_PROFILE
+	uint16_t cycles = (task_ticks(get_ms_clock) - start) * 256;
+	if (cycles > noise_max_cycles) {
+		noise_max_cycles = cycles;
+	}
+#endif
+
+	*wait = FRAME_MS;
+
+	return PATTERN_STATUS_REFRESH;
+
+}
+
+#if AUDIO_ENABLE
+
+/******************************************************************
+ * audio_rings - rings pulse with the audio bands
+ *
+ * Parameter
+ * 		struct RGB *  		Symmetric frame to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * Bass lights the outer ring red, mid the middle ring green and
+ * high the inner ring blue.
+ ******************************************************************/
+
+static uint8_t audio_rings(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
+
+	struct symmetric_frame *frame = (struct symmetric_frame *) data;
+
+	if (status == PATTERN_STATUS_NEW) {
+		frame->map = symmetry_map_plain;
+		audio_start();
+	}
+
+	frame->sector[0] = (struct RGB){ .red = audio_levels[AUDIO_BAND_BASS] >> 1 };
+	frame->sector[1] = (struct RGB){ .green = audio_levels[AUDIO_BAND_MID] >> 1 };
+	frame->sector[2] = (struct RGB){ .blue = audio_levels[AUDIO_BAND_HIGH] >> 1 };
+
+	*wait = AUDIO_BLOCK_MS;
+
+	return PATTERN_STATUS_REFRESH;
+
+}
+
+/******************************************************************
+ * audio_arms - arms light up with the bass
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * The louder the bass, the more arms are lit. The colour mixes
+ * all three bands.
+ ******************************************************************/
+
+static uint8_t audio_arms(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
+
+	uint8_t arms = audio_levels[AUDIO_BAND_BASS] >> 5;
+	struct RGB colour = {
+		.red = audio_levels[AUDIO_BAND_BASS] >> 1,
+		.green = audio_levels[AUDIO_BAND_MID] >> 1,
+		.blue = audio_levels[AUDIO_BAND_HIGH] >> 1,
+	};
+
+	if (status == PATTERN_STATUS_NEW) {
+		audio_start();
+	}
+
+	if (arms > NUM_ARMS) {
+		arms = NUM_ARMS;
+	}
+
+	memset(data, 0, num_leds * sizeof(struct RGB));
+
+	while (arms--) {
+		data[arms * ARM_LEDS] = colour;
+		data[arms * ARM_LEDS + 1] = colour;
+		data[arms * ARM_LEDS + 2] = colour;
+	}
+
+	*wait = AUDIO_BLOCK_MS;
+
+	return PATTERN_STATUS_REFRESH;
+
+}
+
+#endif
+
+#if STREAM_ENABLE
+
+/******************************************************************
+ * stream - frames from a host
+ *
+ * Parameter
+ * 		struct RGB *  		LED data to write
+ * 		uint8_t num_leds	Number of LEDs
+ * 		uint8_t	status		Status of pattern
+ * 		void *unused
+ * 		uint16_t *wait		Returns the time until the next change
+ *
+ * The receiver writes the packets straight into the frame buffer,
+ * so all that is left to do here is show them. A frame that comes
+ * in makes the render task due at once (see render_pending), and
+ * stream_ready stays set until transmit_run has sent it: until
+ * then the receiver leaves the frame buffer alone. While
+ * stream_hold is set, transmit_run sends nothing. The wait is only
+ * there to keep the CPU from powering down, which would stop the
+ * receiver.
+ ******************************************************************/
+
+static uint8_t stream(struct RGB *data, uint8_t num_leds, uint8_t status, void *unused, uint16_t *wait)
+{
+
+	*wait = 1000;
+
+	if (status == PATTERN_STATUS_NEW) {
+		stream_start(data, num_leds);
+		return PATTERN_STATUS_REFRESH;
+	}
+
+	if (stream_ready) {
+		return PATTERN_STATUS_REFRESH;
+	}
+
+	return PATTERN_STATUS_NOCHANGE;
+
+}
+
+#endif
+
+
+/******************************************************************
+ * init_IO: initialise I/O pins
+ ******************************************************************/
+
+static void init_IO(void)
+{
+
+	DDRB = 0b00000001;	// All input except PB0
+    PORTB = 0b11111110; // All pullup, PB0 low
+
+}
+
+/******************************************************************
+ * init_system_timer: initialise Timer0 as the system clock
+ *
+ * Timer0 runs in CTC mode with a /256 prescaler and counts to 77
+ * This results in ISR every ms (0.9984ms at 20MHz), which keeps
+ * ms_clock. Every SLICE_MS of those the button is debounced and
+ * demo mode is timed.
+ *
+ * The timer stops with the clock in power down, which is only used
+ * when nothing needs timing.
+ ******************************************************************/
+
+#define SLICE_MS	10	// Length of a debounce/demo time slice in ms
+
+static void init_system_timer(void) 
+{
+
+	// CTC mode
+	TCCR0A &= ~(1 << WGM00);
+	TCCR0A |= (1 << WGM01);
+	TCCR0B &= ~(1 << WGM02);
+
+	// Count to 77
+	OCR0A = (F_CPU / 256 / 1000) - 1;
+
+	// Enable Compare Match interrupt
+	TIMSK |= (1 << OCIE0A);
+
+	// Start timer with prescaler /256
+	TCCR0B |= (1 << CS02);
+	TCCR0B &= ~(1 << CS01 | 1 << CS00);
+
+}
+
+/******************************************************************
+ * init_button_interrupt: initialise the pin change interrupt
+ *
+ * A pin change on the button starts debouncing. It also wakes the
+ * MCU from power down.
+ ******************************************************************/
+
+static void init_button_interrupt(void)
+{
+
+	PCMSK |= (1 << BUTTON);		// PCINTn is on PBn
+	GIMSK |= (1 << PCIE);
+
+}
+
+volatile uint8_t short_press = 0;
+volatile uint8_t long_press = 0;
+volatile uint8_t next_pattern = 0;
+volatile uint8_t demo_mode = 0;
+volatile struct button button = { 0, 0 };
+volatile uint8_t button_press_acknowledged = 1;
+volatile uint16_t demo_time_counter = 0;
+volatile uint16_t ms_clock = 0;
+uint8_t slice_ms = 0;
+
+volatile uint8_t sync_pattern = SYNC_NO_PATTERN;	// Pattern the sync line switches to
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+volatile uint8_t sync_pulse_ms = 0;		// Rest of the pulse being sent and the gap after it
+volatile uint8_t sync_pulse_ended = 0;	// Pulse for sync_pattern is over, change to it
+#elif SYNC_ROLE == SYNC_ROLE_SLAVE
+volatile uint16_t sync_pulse_start;		// ms_clock at the start of the last pulse
+volatile uint8_t sync_pulse_low = 0;	// Start of the pulse was seen
+volatile uint16_t sync_lock_count = 0;	// Slices until the master counts as gone
+volatile uint8_t sync_frame = 0;		// Pulse started, draw the next frame
+#endif
+
+/* A pattern change to act on. The master keeps one that comes in
+ * during a sync pulse until the pulse is over */
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+#define NEXT_PATTERN_PENDING	((next_pattern && !sync_pulse_ms) || sync_pulse_ended)
+#else
+#define NEXT_PATTERN_PENDING	(next_pattern)
+#endif
+
+#ifdef STACK_PROFILE
+/* Deepest stack in bytes, see stack.h */
+uint16_t stack_pattern_max[NUM_PATTERNS];
+uint16_t stack_isr_button;
+uint16_t stack_isr_timer;
+uint16_t stack_isr_adc;
+uint16_t stack_isr_sync;
+#endif
+
+/******************************************************************
+ * Pin change interrupt: button pressed
+ *
+ * Only the press is of interest. From here on the pin change
+ * interrupt is off and the timer debounces, so contact bounce
+ * costs no interrupts.
+ ******************************************************************/
+
+ISR(PCINT0_vect)
+{
+
+	STACK_ISR(stack_isr_button);
+
+	if (bit_is_clear(PINB,BUTTON) && button_press_acknowledged && button.down_count == 0) {
+
+		GIMSK &= ~(1 << PCIE);
+		button_press(&button);
+
+	}
+
+}
+
+/******************************************************************
+ * Timer0 compare match interrupt: system clock, debounce button
+ * press
+ *
+ * Every SLICE_MS the button is sampled and fed to the gesture
+ * detector in button.h, while a push is going on.
+ ******************************************************************/
+
+ISR(TIM0_COMPA_vect)
+{
+
+	STACK_ISR(stack_isr_timer);
+
+	ms_clock++;
+
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+	// End of a sync pulse: the master changes pattern together with the
+	// slaves. The line is then left high for SYNC_GAP_MS before the next
+	if (sync_pulse_ms && --sync_pulse_ms == SYNC_GAP_MS) {
+		DDRB &= ~(1 << SYNC_PIN);
+		PORTB |= (1 << SYNC_PIN);
+		if (sync_pattern != SYNC_NO_PATTERN) {
+			sync_pulse_ended = 1;
+		}
+	}
+#endif
+
+	if (++slice_ms < SLICE_MS) {
+		return;
+	}
+
+	slice_ms = 0;
+
+	if (button_press_acknowledged && button.down_count) {
+
+		switch (button_slice(&button, bit_is_clear(PINB,BUTTON))) {
+
+			case BUTTON_EVENT_SHORT:
+				short_press = 1;
+				button_press_acknowledged = 0;
+				break;
+
+			case BUTTON_EVENT_LONG:
+				long_press = 1;
+				button_press_acknowledged = 0;
+				break;
+
+		}
+
+	}
+
+	if (button.down_count == 0 && !(GIMSK & (1 << PCIE))) {
+
+		// Debounce done: forget the bounces, listen for the next press
+		GIFR = (1 << PCIF);
+		GIMSK |= (1 << PCIE);
+
+	}
+
+#if SYNC_ROLE == SYNC_ROLE_SLAVE
+	// A slave that hears the master leaves the timing to it
+	if (sync_lock_count) {
+		sync_lock_count--;
+		demo_time_counter = 0;
+	}
+#endif
+
+	if (demo_mode) {
+	
+		if(++demo_time_counter == DEMO_TIME_COUNT) {
+			demo_time_counter = 0;
+			next_pattern = 1;
+		}
+
+	}
+
+}
+
+#if SYNC_ROLE == SYNC_ROLE_SLAVE
+
+/******************************************************************
+ * INT0 interrupt: edge on the sync line
+ *
+ * The master pulls the line low for SYNC_PULSE_MS(pattern) and
+ * changes to that pattern when it lets go, and for
+ * SYNC_FRAME_PULSE_MS when it starts a frame. So the slave draws
+ * its next frame on the falling edge, together with the master,
+ * and times the pulse: on the rising edge it changes to the same
+ * pattern (see sync.h for the pulse code). A pattern pulse so
+ * only costs the slave one more frame of the current pattern. A
+ * pulse that came and went while interrupts were off shows up as
+ * a rising edge only, and is ignored.
+ ******************************************************************/
+
+ISR(INT0_vect)
+{
+
+	uint8_t pattern;
+
+	STACK_ISR(stack_isr_sync);
+
+	if (bit_is_clear(PINB, SYNC_PIN)) {
+
+		sync_pulse_start = ms_clock;
+		sync_pulse_low = 1;
+		sync_frame = 1;
+
+	} else if (sync_pulse_low) {
+
+		sync_pulse_low = 0;
+		pattern = sync_decode(ms_clock - sync_pulse_start);
+
+		if (pattern == SYNC_FRAME) {
+			sync_lock_count = SYNC_LOCK_COUNT;
+		} else if (pattern < NUM_PATTERNS) {
+			sync_pattern = pattern;
+			sync_lock_count = SYNC_LOCK_COUNT;
+			next_pattern = 1;
+		}
+
+	}
+
+}
+
+#endif
+
+#if STREAM_ENABLE
+
+/******************************************************************
+ * INT0 interrupt: start bit on the stream line
+ ******************************************************************/
+
+ISR(INT0_vect)
+{
+
+	STACK_ISR(stack_isr_sync);
+
+	stream_receive(ms_clock);
+
+}
+
+#endif
+
+#if SYNC_ROLE != SYNC_ROLE_NONE
+
+/******************************************************************
+ * init_sync: initialise the sync line
+ *
+ * The line is open drain with the pull-ups of all snowflakes on
+ * it: the master only ever pulls it low. The slave gets an
+ * interrupt on both edges of the pulse.
+ ******************************************************************/
+
+static void init_sync(void)
+{
+
+	DDRB &= ~(1 << SYNC_PIN);
+	PORTB |= (1 << SYNC_PIN);
+
+#if SYNC_ROLE == SYNC_ROLE_SLAVE
+	MCUCR = (MCUCR & ~(1 << ISC01)) | (1 << ISC00);		// Any change
+	GIFR = (1 << INTF0);
+	GIMSK |= (1 << INT0);
+#endif
+
+}
+
+#endif
+
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+
+/******************************************************************
+ * sync_send: tell the slaves which pattern comes next, or that a
+ * frame starts
+ *
+ * Parameters:
+ *		uint8_t		pattern, or SYNC_FRAME
+ *
+ * Starts the pulse and returns. Only call while no pulse is being
+ * sent. The timer interrupt ends it, and for a pattern sets
+ * sync_pulse_ended, so the master changes pattern at the same
+ * moment as the slaves.
+ ******************************************************************/
+
+static void sync_send(uint8_t pattern)
+{
+
+	uint8_t ms = SYNC_FRAME_PULSE_MS;
+
+	if (pattern != SYNC_FRAME) {
+		sync_pattern = pattern;
+		ms = SYNC_PULSE_MS(pattern);
+	}
+
+	PORTB &= ~(1 << SYNC_PIN);
+	DDRB |= (1 << SYNC_PIN);
+
+	cli();
+	sync_pulse_ms = ms + SYNC_GAP_MS;
+	sei();
+
+}
+
+#endif
+
+#if AUDIO_ENABLE || SENSORS_ENABLE
+
+/******************************************************************
+ * ADC conversion complete interrupt
+ *
+ * The ADC runs free while an audio pattern samples, and does
+ * single conversions for the sensors otherwise.
+ ******************************************************************/
+
+ISR(ADC_vect)
+{
+
+	STACK_ISR(stack_isr_adc);
+
+#if AUDIO_ENABLE
+	if (ADCSRA & (1 << ADATE)) {
+		audio_sample();
+		return;
+	}
+#endif
+
+#if SENSORS_ENABLE
+	sensors_sample();
+#endif
+
+}
+
+#endif
+
+/******************************************************************
+ * get_ms_clock: read ms_clock
+ *
+ * Returns:
+ *		uint16_t	ms since start, wrapping around every 65s
+ ******************************************************************/
+
+static uint16_t get_ms_clock(void)
+{
+
+	uint8_t sreg = SREG;
+	uint16_t now;
+
+	cli();
+	now = ms_clock;
+	SREG = sreg;
+
+	return now;
+
+}
+
+#if CLOCK_SLOW
+
+#ifdef CLOCK_PROFILE
+uint32_t clock_slow_ms = 0;					// Time at the slow clock, this pattern
+uint32_t clock_full_ms = 0;					// Time at F_CPU, this pattern
+uint16_t clock_mark = 0;					// ms_clock at the last switch
+uint8_t clock_slow_share[NUM_PATTERNS];		// Time at the slow clock, in 256ths
+
+static void clock_account(uint32_t *time)
+{
+
+	uint16_t now = get_ms_clock();
+
+	*time += (uint16_t) (now - clock_mark);
+	clock_mark = now;
+
+}
+
+/* Share of the time the pattern ran at the slow clock. Going through
+ * the patterns in demo mode fills in the whole table */
+static void clock_profile_pattern(uint8_t pattern)
+{
+
+	uint32_t total;
+
+	clock_account(&clock_full_ms);
+	total = clock_slow_ms + clock_full_ms;
+
+	if (total) {
+		clock_slow_share[pattern] = clock_slow_ms * 255 / total;
+	}
+
+	clock_slow_ms = 0;
+	clock_full_ms = 0;
+
+}
+#endif
+
+/******************************************************************
+ * clock_slow: divide the system clock by 32
+ * clock_full: back to F_CPU
+ *
+ * Returns:
+ *		uint8_t		clock_slow: non-zero if the clock is slow now
+ *
+ * While idle nothing runs between interrupts, so the clock only
+ * has to keep Timer0 going. Timer0 moves from CK/256 to CK/8 with
+ * it, so its counts and the ms tick keep their length, and so does
+ * everything timed from the ms clock: debouncing, demo mode, the
+ * patterns. A switch can lose part of a Timer0 count (12.8us at
+ * 20MHz), at most 0.1% with a switch every frame.
+ *
+ * The clock stays at F_CPU while the ADC converts, as the ADC
+ * clock would drop below 50kHz, and while the stream receiver is
+ * on, as it counts cycles to read bits. Sending frames always
+ * happens after clock_full.
+ *
+ * What it saves, from the typical curves of the ATtiny85 datasheet
+ * at 5V: 11mA active at 20MHz, 3mA idle at 20MHz and 0.2mA idle at
+ * 625kHz. The ms tick at the slow clock adds about 0.04mA. With
+ * the share of the time each pattern is busy, rendering and
+ * sending (a frame is 0.54ms on the line), that gives:
+ *
+ *	pattern						busy	F_CPU	CLOCK_SLOW
+ *	fill_single_colour			-		power down, 0.1uA
+ *	rainbow, fade_colours,		0.5%	3.0mA	0.3mA
+ *	crazy and the other patterns
+ *	stepping every 100ms or more
+ *	animation, particles		4%		3.3mA	0.7mA
+ *	rainbow_wheel, walking_*	5%		3.4mA	0.8mA
+ *	frost						6%		3.5mA	0.9mA
+ *	aurora						9%		3.7mA	1.2mA
+ *	audio_*, stream				-		3.0mA and more: never slow
+ *
+ * The busy shares are from the cycle counts by hand in this file.
+ * Build with -DCLOCK_PROFILE to measure them: clock_slow_share is
+ * 255 minus the busy share in 256ths. The curves are for an
+ * external clock, so the crystal oscillator, which runs on at
+ * 20MHz, comes on top, and the LEDs draw about 1mA each even when
+ * dark: the saving is real but the chip is not the biggest load.
+ ******************************************************************/
+
+static uint8_t clock_slow(void)
+{
+
+	if (ADCSRA & (1 << ADSC)) {
+		return 0;
+	}
+
+#if STREAM_ENABLE
+	if (GIMSK & (1 << INT0)) {
+		return 0;
+	}
+#endif
+
+#ifdef CLOCK_PROFILE
+	clock_account(&clock_full_ms);
+#endif
+
+	cli();
+	clock_prescale_set(clock_div_32);
+	TCCR0B = (TCCR0B & ~(1 << CS02 | 1 << CS01 | 1 << CS00)) | (1 << CS01);
+	sei();
+
+	return 1;
+
+}
+
+static void clock_full(void)
+{
+
+	cli();
+	TCCR0B = (TCCR0B & ~(1 << CS02 | 1 << CS01 | 1 << CS00)) | (1 << CS02);
+	clock_prescale_set(clock_div_1);
+	sei();
+
+#ifdef CLOCK_PROFILE
+	clock_account(&clock_slow_ms);
+#endif
+
+}
+
+#endif
+
+/******************************************************************
+ * sleep_until: idle until a point in time or a button push
+ *
+ * Parameters:
+ *		uint16_t	ms_clock value to wake up at
+ *
+ * The CPU sleeps between system clock interrupts, and stops
+ * sleeping as soon as a button push comes in, so it is handled
+ * within a millisecond. So does a streamed frame. With CLOCK_SLOW
+ * the system clock is slowed down meanwhile.
+ ******************************************************************/
+
+static void sleep_until(uint16_t deadline)
+{
+
+#if CLOCK_SLOW
+	uint8_t slow = 0;
+#endif
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	while ((int16_t) (get_ms_clock() - deadline) < 0) {
+
+#if CLOCK_SLOW
+		if (!slow) {
+			slow = clock_slow();
+		}
+#endif
+
+		cli();
+
+#if STREAM_ENABLE
+		if (short_press || long_press || NEXT_PATTERN_PENDING || stream_ready) {
+#elif SYNC_ROLE == SYNC_ROLE_SLAVE
+		if (short_press || long_press || NEXT_PATTERN_PENDING || sync_frame) {
+#else
+		if (short_press || long_press || NEXT_PATTERN_PENDING) {
+#endif
+			sei();
+			break;
+		}
+
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+
+	}
+
+#if CLOCK_SLOW
+	if (slow) {
+		clock_full();
+	}
+#endif
+
+}
+
+/******************************************************************
+ * sleep_until_button: power down until the button is pressed
+ *
+ * Returns:
+ *		uint8_t		non-zero if it powered down
+ *
+ * Only used when nothing on the LEDs can change without a button
+ * press. The check and the sleep are atomic, so a press that comes
+ * in between still wakes us up. While a press is being debounced
+ * or a sync pulse sent, the timer has to keep running, so it
+ * returns at once and the caller idles instead.
+ ******************************************************************/
+
+static uint8_t sleep_until_button(void)
+{
+
+	uint8_t slept = 0;
+
+#if SYNC_ROLE == SYNC_ROLE_SLAVE
+	set_sleep_mode(SLEEP_MODE_IDLE);	// INT0 edges need the I/O clock
+#else
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+#endif
+
+	cli();
+
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+	if (button.down_count == 0 && button_press_acknowledged && !demo_mode && !sync_pulse_ms) {
+#else
+	if (button.down_count == 0 && button_press_acknowledged && !demo_mode) {
+#endif
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		slept = 1;
+	}
+
+	sei();
+
+	return slept;
+
+}
+
+/******************************************************************
+ * dimmed_shader: run the shader of a shader frame, dimmed
+ * 
+ * Parameters:
+ *
+ *		uint8_t led			LED
+ *		uint16_t time		Frame time
+ *		void *frame			struct shader_frame to draw
+ *
+ * Returns:
+ *		struct RGB			colour
+ ******************************************************************/
+
+static struct RGB dimmed_shader(uint8_t led, uint16_t time, void *frame)
+{
+
+	struct shader_frame *sf = (struct shader_frame *) frame;
+	struct RGB colour = sf->pf->shader(led, time, sf->pf->extra_parameter);
+
+	if (sf->shift) {
+		colour.red >>= sf->shift;
+		colour.green >>= sf->shift;
+		colour.blue >>= sf->shift;
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		colour.white >>= sf->shift;
+#endif
+	}
+
+	return colour;
+
+}
+
+/******************************************************************
+ * frame_colours: the colours a frame is built from
+ * 
+ * Parameters:
+ *
+ *		struct RGB *data		frame buffer
+ *		uint8_t flags			flags of the pattern that drew the frame
+ *		uint8_t *num_colours	returns the number of colours
+ *
+ * Returns:
+ *		struct RGB *			colours
+ *
+ * These are the LED data of an RGB frame, the palette of an
+ * indexed frame or the sector of a symmetric frame. Fading or
+ * flashing a frame only has to deal with these.
+ ******************************************************************/
+
+static struct RGB *frame_colours(struct RGB *data, uint8_t flags, uint8_t *num_colours)
+{
+
+	if (flags & PATTERN_FLAG_INDEXED) {
+		*num_colours = PALETTE_SIZE;
+		return ((struct indexed_frame *) data)->palette;
+	}
+
+	if (flags & PATTERN_FLAG_SYMMETRIC) {
+		*num_colours = ARM_LEDS;
+		return ((struct symmetric_frame *) data)->sector;
+	}
+
+	*num_colours = NUM_LEDS;
+	return data;
+
+}
+
+/******************************************************************
+ * Overlay layers
+ *
+ * Short-lived layers drawn over the pattern, such as the flash
+ * that acknowledges a long press. They are blended in while the
+ * frame goes out: as long as a layer is active, show_frame sends
+ * every kind of frame through composite_shader, which looks up the
+ * pattern's colour of each LED and lays the layers over it. So the
+ * frame buffer is never changed or copied, and the main loop goes
+ * on running the pattern and reading the button under the layers.
+ *
+ * Each layer has a blend mode:
+ *
+ *	LAYER_BLEND_ADD			layer colour added, saturating
+ *	LAYER_BLEND_MULTIPLY	pattern scaled per channel by the layer
+ *	LAYER_BLEND_REPLACE		layer colour, where it is not black
+ *
+ * The update function of a layer runs once per loop, with the age
+ * of the layer set, to work out whatever is the same for all LEDs.
+ * Its shader then only picks a colour per LED. A layer adds at
+ * most three scale8 calls per LED to the pattern, which keeps a
+ * shader frame inside WS2812_SHADER_BUDGET_CYCLES.
+ ******************************************************************/
+
+#define NUM_LAYERS				2
+
+#define LAYER_BLEND_ADD			0
+#define LAYER_BLEND_MULTIPLY	1
+#define LAYER_BLEND_REPLACE		2
+
+struct layer {
+	void (*update)(struct layer *);						// NULL if not needed
+	struct RGB (*shader)(uint8_t, struct layer *);		// Colour of an LED, NULL when not in use
+	uint8_t blend;			// LAYER_BLEND_*
+	uint16_t start;			// ms_clock when the layer was shown
+	uint16_t duration;		// ms until it goes away by itself
+	uint16_t age;			// ms since start
+	struct RGB colour;		// For the shader
+};
+
+struct layer layers[NUM_LAYERS];
+uint8_t num_active_layers = 0;
+
+struct composite_frame {
+	struct RGB *data;		// Frame buffer
+	uint8_t flags;			// Flags of the pattern that drew it
+};
+
+/******************************************************************
+ * layers_update: age the layers and drop the ones that are over
+ * 
+ * Parameters:
+ *
+ *		uint16_t now		ms_clock
+ *
+ * Sets num_active_layers.
+ ******************************************************************/
 
-	// Don't leave memory hanging around
-	free(buffer);
+static void layers_update(uint16_t now)
+{
+
+	struct layer *layer;
+	uint8_t active = 0;
+
+	for (layer = layers; layer < layers + NUM_LAYERS; layer++) {
+
+		if (layer->shader == NULL) {
+			continue;
+		}
+
+		layer->age = now - layer->start;
+
+		if (layer->age >= layer->duration) {
+			layer->shader = NULL;
+			continue;
+		}
+
+		if (layer->update) {
+			layer->update(layer);
+		}
+
+		active++;
+
+	}
+
+	num_active_layers = active;
 
 }
 
 /******************************************************************
- * Main 
+ * layer_show: show a layer
+ * 
+ * Parameters:
+ *
+ *		update				update function, or NULL
+ *		shader				colour of an LED
+ *		uint8_t blend		LAYER_BLEND_*
+ *		uint16_t duration	ms to show it for
+ *		struct RGB colour	colour for the shader
+ *		uint16_t now		ms_clock
+ *
+ * A layer with the same shader is started again. Otherwise the
+ * first free layer is taken, or the first one if none is free.
  ******************************************************************/
 
-int main(void)
+static void layer_show(void (*update)(struct layer *), struct RGB (*shader)(uint8_t, struct layer *),
+		uint8_t blend, uint16_t duration, struct RGB colour, uint16_t now)
 {
 
-	uint8_t pattern_status = PATTERN_STATUS_NEW;
-	uint8_t current_pattern = 0;
-	uint8_t fading = 0;
-	
-	struct patternfunc fade_down_pf = { fade_down, (void *) &pattern_counter };
-	
-	struct RGB *led_data = malloc(sizeof(struct RGB) * NUM_LEDS);
+	struct layer *layer = &layers[0];
+	uint8_t i;
 
-    // pattern_status = patternfunc(data, NUM_LEDS, pattern_status, param);	
-    // on next pattern, reset pattern_status to 0
+	for (i = 0; i < NUM_LAYERS; i++) {
+		if (layers[i].shader == shader) {
+			layer = &layers[i];
+			break;
+		}
+		if (layers[i].shader == NULL && layer->shader != NULL) {
+			layer = &layers[i];
+		}
+	}
 
-	init_IO();
-	init_debounce_timer();
-	sei();
+	layer->update = update;
+	layer->shader = shader;
+	layer->blend = blend;
+	layer->start = now;
+	layer->duration = duration;
+	layer->colour = colour;
 
-	srand(42);
+	layers_update(now);
 
-	while (1) {
+}
 
-		struct patternfunc pf;
+/******************************************************************
+ * base_pixel: colour of an LED in a frame of any kind
+ * 
+ * Parameters:
+ *
+ *		uint8_t led					LED
+ *		uint16_t time				Frame time, for shader frames
+ *		struct composite_frame *cf	Frame
+ *
+ * Returns:
+ *		struct RGB					colour
+ ******************************************************************/
 
-		// Fetch pattern function
-		if (! fading ) {
-			pf = pattern_functions[current_pattern];
-		} else {
-			pf = fade_down_pf;
+static struct RGB base_pixel(uint8_t led, uint16_t time, struct composite_frame *cf)
+{
+
+	if (cf->flags & PATTERN_FLAG_SHADER) {
+		return dimmed_shader(led, time, &current_shader_frame);
+	}
+
+	if (cf->flags & PATTERN_FLAG_INDEXED) {
+
+		struct indexed_frame *frame = (struct indexed_frame *) cf->data;
+		uint8_t index;
+
+#if WS2812_PALETTE_BITS == 4
+		index = frame->index[led >> 1];
+		if (led & 1) {
+			index >>= 4;
 		}
+		index &= 0x0f;
+#else
+		index = frame->index[led];
+#endif
+
+		return frame->palette[index];
+
+	}
 
-		// Run pattern function
-		pattern_status = pf.run_pattern(led_data, NUM_LEDS, pattern_status, pf.extra_parameter);
+	if (cf->flags & PATTERN_FLAG_SYMMETRIC) {
+		struct symmetric_frame *frame = (struct symmetric_frame *) cf->data;
+		return frame->sector[pgm_read_byte(&frame->map[led])];
+	}
 
-		// Check status
-		switch (pattern_status) {
+	return cf->data[led];
 
-			case PATTERN_STATUS_REFRESH:
+}
 
-				send_frame(led_data, NUM_LEDS, LED_PIN);
-				break;
+/******************************************************************
+ * composite_shader: a frame with the active layers over it
+ * 
+ * Parameters:
+ *
+ *		uint8_t led			LED
+ *		uint16_t time		Frame time
+ *		void *frame			struct composite_frame to draw
+ *
+ * Returns:
+ *		struct RGB			colour
+ ******************************************************************/
+
+static struct RGB composite_shader(uint8_t led, uint16_t time, void *frame)
+{
 
-			case PATTERN_STATUS_FADE_DONE:
+	struct RGB colour = base_pixel(led, time, (struct composite_frame *) frame);
+	struct layer *layer;
 
-				fading = 0;
-				pattern_status = PATTERN_STATUS_NEW;
-				break;
+	for (layer = layers; layer < layers + NUM_LAYERS; layer++) {
+
+		if (layer->shader == NULL) {
+			continue;
+		}
+
+		struct RGB top = layer->shader(led, layer);
+
+		switch (layer->blend) {
+
+		case LAYER_BLEND_ADD:
+			add_colour(&colour, top);
+			break;
+
+		case LAYER_BLEND_MULTIPLY:
+			colour = multiply_colour(colour, top);
+			break;
+
+		default:
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+			if (top.red | top.green | top.blue | top.white) {
+#else
+			if (top.red | top.green | top.blue) {
+#endif
+				colour = top;
+			}
+			break;
 
 		}
 
-		// Check for short button press: next pattern
-		if (!demo_mode && short_press) {
-			short_press = 0;
-			button_press_acknowledged = 1;
+	}
+
+	return colour;
+
+}
+
+/******************************************************************
+ * show_frame: send out a frame of either kind
+ * 
+ * Parameters:
+ *
+ *		struct RGB *data	frame buffer
+ *		uint8_t flags		flags of the pattern that drew the frame
+ *
+ * Shader frames are drawn by current_shader_frame. With layers
+ * active, every frame goes out through composite_shader.
+ ******************************************************************/
+
+static void show_frame(struct RGB *data, uint8_t flags)
+{
+
+	if (num_active_layers) {
+
+		struct composite_frame cf = { data, flags };
+
+		send_frame_shader(composite_shader, &cf, frame_time, NUM_LEDS, LED_PIN);
+
+	} else if (flags & PATTERN_FLAG_SHADER) {
+
+		send_frame_shader(dimmed_shader, &current_shader_frame, frame_time, NUM_LEDS, LED_PIN);
+
+	} else if (flags & PATTERN_FLAG_INDEXED) {
+
+		send_frame_indexed(((struct indexed_frame *) data)->index, ((struct indexed_frame *) data)->palette, NUM_LEDS, LED_PIN);
+
+	} else if (flags & PATTERN_FLAG_SYMMETRIC) {
+
+		send_frame_mapped(((struct symmetric_frame *) data)->map, ((struct symmetric_frame *) data)->sector, NUM_LEDS, LED_PIN);
+
+	} else {
+
+		send_frame(data, NUM_LEDS, LED_PIN);
+
+	}
+
+}
+
+/******************************************************************
+ * Long press acknowledgement
+ *
+ * The whole frame flashes NUM_QUICK_FLASH times: it is halved
+ * once more every QUICK_FLASH_DELAY ms, seven times, and then
+ * shown at full brightness again. Over that the inner LEDs show
+ * whether demo mode is now on (green) or off (red).
+ ******************************************************************/
+
+static void flash_update(struct layer *layer)
+{
+
+	uint8_t shift = (layer->age / QUICK_FLASH_DELAY + 1) & 0x07;
+	uint8_t gain = shift ? 0x100 >> shift : 0xff;
+
+	layer->colour = (struct RGB){
+		.red = gain,
+		.green = gain,
+		.blue = gain,
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		.white = gain,
+#endif
+	};
+
+}
+
+static struct RGB flash_shader(uint8_t led, struct layer *layer)
+{
+
+	return layer->colour;
+
+}
+
+static struct RGB demo_indicator_shader(uint8_t led, struct layer *layer)
+{
+
+	if (pgm_read_byte(&symmetry_map_plain[led]) == ARM_LEDS - 1) {
+		return layer->colour;
+	}
+
+	return (struct RGB){ 0 };
+
+}
+
+static void acknowledge_long_press(uint16_t now)
+{
+
+	struct RGB indicator = demo_mode ? (struct RGB){ .green = 64 } : (struct RGB){ .red = 64 };
+
+	layer_show(flash_update, flash_shader, LAYER_BLEND_MULTIPLY, QUICK_FLASH_MS, (struct RGB){ 0 }, now);
+	layer_show(NULL, demo_indicator_shader, LAYER_BLEND_REPLACE, QUICK_FLASH_MS, indicator, now);
+
+}
+
+/******************************************************************
+ * Tasks
+ *
+ * The main loop is a handful of tasks, run by tasks_run in the
+ * order of the table below: button presses go first, then a
+ * frame that is ready goes out, then the next frame is drawn,
+ * and whatever time is left goes to the sensors. Each task does
+ * one step and returns, and the CPU sleeps until the next one is
+ * due or a button press comes in.
+ ******************************************************************/
+
+enum {
+	TASK_INPUT,					// Button presses, pattern changes
+	TASK_TRANSMIT,				// Frames and overlay layers to the LEDs
+	TASK_RENDER,				// Patterns and fading
+#if SENSORS_ENABLE
+	TASK_SENSORS,				// Battery and light measurements
+#endif
+	NUM_TASKS
+};
+
+static uint8_t input_pending(void);
+static uint8_t transmit_pending(void);
+static void input_run(struct task *, uint16_t);
+static void transmit_run(struct task *, uint16_t);
+static void render_run(struct task *, uint16_t);
+#if STREAM_ENABLE || SYNC_ROLE == SYNC_ROLE_SLAVE
+static uint8_t render_pending(void);
+#endif
+#if SENSORS_ENABLE
+static void sensors_run(struct task *, uint16_t);
+#endif
+
+struct task tasks[NUM_TASKS] = {
+	[TASK_INPUT] = { .run = input_run, .pending = input_pending },
+	[TASK_TRANSMIT] = { .run = transmit_run, .pending = transmit_pending },
+#if STREAM_ENABLE || SYNC_ROLE == SYNC_ROLE_SLAVE
+	[TASK_RENDER] = { .run = render_run, .pending = render_pending },
+#else
+	[TASK_RENDER] = { .run = render_run },
+#endif
+#if SENSORS_ENABLE
+	[TASK_SENSORS] = { .run = sensors_run },
+#endif
+};
+
+uint8_t pattern_status = PATTERN_STATUS_NEW;
+uint8_t current_pattern = 0;
+uint8_t fading = 0;
+uint8_t frame_flags = 0;		// Flags of the pattern that drew the frame buffer
+uint8_t frame_ready = 0;		// Frame buffer drawn, not sent yet
+uint8_t overlay_shown = 0;		// Last frame sent had overlay layers in it
+uint16_t render_wait = 0;		// Time until the pattern changes next
+
+#ifdef STACK_PROFILE
+/* The pattern and sending its frame, plus any ISR in between */
+static void stack_record(void)
+{
+
+	if (!fading && stack_used() > stack_pattern_max[current_pattern]) {
+		stack_pattern_max[current_pattern] = stack_used();
+	}
+
+}
+#endif
+
+static uint8_t input_pending(void)
+{
+
+	return short_press || long_press || NEXT_PATTERN_PENDING;
+
+}
+
+static uint8_t transmit_pending(void)
+{
+
+	return frame_ready;
+
+}
+
+#if STREAM_ENABLE
+static uint8_t render_pending(void)
+{
+
+	return stream_ready && !frame_ready;
+
+}
+#elif SYNC_ROLE == SYNC_ROLE_SLAVE
+static uint8_t render_pending(void)
+{
+
+	return sync_frame;
+
+}
+#endif
+
+static void input_run(struct task *task, uint16_t now)
+{
+
+	task->wake = now + TASK_FOREVER;
+
+	// Check for short button press: next pattern, ignored in demo mode
+	if (short_press) {
+		short_press = 0;
+		button_press_acknowledged = 1;
+		if (!demo_mode) {
 			next_pattern = 1;
 		}
+	}
 
-		// Check for long button press: demo mode
-		if (long_press) {
-			long_press = 0;
-			demo_time_counter = 0;
-			quick_flash_leds(led_data, NUM_LEDS); // Acknowledge the press
-			demo_mode ^= 0x01;
-			button_press_acknowledged = 1;
+	// Check for long button press: demo mode
+	if (long_press) {
+		long_press = 0;
+		demo_time_counter = 0;
+		demo_mode ^= 0x01;
+		acknowledge_long_press(now);
+		tasks[TASK_TRANSMIT].wake = now;
+		button_press_acknowledged = 1;
+	}
+
+	// Check for next pattern: can come from button press, ISR in demo
+	// mode or the sync line
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+	// Announce it first: the pattern changes at the end of the pulse.
+	// One that comes in while a pulse is sent waits for it to end
+	if (next_pattern && !sync_pulse_ms && sync_pattern == SYNC_NO_PATTERN) {
+		next_pattern = 0;
+		sync_send(current_pattern + 1 == NUM_PATTERNS ? 0 : current_pattern + 1);
+	}
+	if (sync_pulse_ended) {
+		sync_pulse_ended = 0;
+#else
+	if (next_pattern) {
+		next_pattern = 0;
+#endif
+#if AUDIO_ENABLE
+		audio_stop();
+#endif
+#if STREAM_ENABLE
+		stream_stop();
+#endif
+#if CLOCK_SLOW && defined(CLOCK_PROFILE)
+		clock_profile_pattern(current_pattern);
+#endif
+		pattern_status = PATTERN_STATUS_NEW;
+		if (sync_pattern != SYNC_NO_PATTERN) {
+			current_pattern = sync_pattern;
+			sync_pattern = SYNC_NO_PATTERN;
+		} else if (++current_pattern == NUM_PATTERNS) {
+			current_pattern = 0;
 		}
+		fading = 1;
+		tasks[TASK_RENDER].wake = now;
+	}
 
-		// Check for next pattern: can come from button press or ISR in demo mode
-		if (next_pattern) {
-			next_pattern = 0;
-			pattern_status = PATTERN_STATUS_NEW;
-			if (++current_pattern == NUM_PATTERNS) {current_pattern = 0;}
-			fading = 1;
+}
+
+static void transmit_run(struct task *task, uint16_t now)
+{
+
+	layers_update(now);
+
+#if STREAM_ENABLE
+	// Part of a packet in the frame buffer: the LEDs keep the last
+	// frame. Interrupts stay off from here until the frame is out
+	// (output_end turns them on), so no packet starts in between
+	cli();
+	if (stream_hold) {
+		sei();
+		frame_ready = 0;
+		task->wake = now + FRAME_MS;
+		return;
+	}
+#endif
+
+	// Overlays move on by themselves, whether the pattern changes or
+	// not. Once the last one has gone, one more frame clears it
+	if (frame_ready || ((num_active_layers || overlay_shown) && pattern_status != PATTERN_STATUS_NEW)) {
+
+#if STREAM_ENABLE
+		uint8_t streamed = stream_ready;
+#endif
+
+		show_frame((struct RGB *) framebuffer, frame_flags);
+		overlay_shown = num_active_layers;
+
+#if STREAM_ENABLE
+		// Sent: the receiver may change the frame buffer again
+		if (streamed) {
+			stream_ready = 0;
 		}
-	
-		_delay_ms(FRAME_DELAY);
+#endif
+
+#ifdef STACK_PROFILE
+		if (frame_ready) {
+			stack_record();
+		}
+#endif
+
+	}
 
+#if STREAM_ENABLE
+	sei();
+#endif
+
+	frame_ready = 0;
+	task->wake = now + (num_active_layers || overlay_shown ? FRAME_MS : TASK_FOREVER);
+
+}
+
+static void render_run(struct task *task, uint16_t now)
+{
+
+	static const struct patternfunc fade_down_pf = { fade_down, NULL };
+	static const struct patternfunc fade_down_shader_pf = { fade_down_shader, NULL };
+
+	struct RGB *led_data = (struct RGB *) framebuffer;
+	struct patternfunc pf;
+
+	// Fetch pattern function
+	if (! fading ) {
+		pf = pattern_functions[current_pattern];
+		frame_flags = pf.flags;
+		current_shader_frame.pf = &pattern_functions[current_pattern];
+		current_shader_frame.shift = 0;
+	} else if (frame_flags & PATTERN_FLAG_SHADER) {
+		pf = fade_down_shader_pf;
+	} else {
+		pf = fade_down_pf;
+	}
+
+	frame_time = now;
+
+	if (pattern_status == PATTERN_STATUS_NEW) {
+		pattern_start = now;
+	}
+
+#if SYNC_ROLE == SYNC_ROLE_MASTER
+	// Frame pulse, so the slaves draw this frame too. Not while a
+	// pattern change is announced or pending
+	if (!sync_pulse_ms && sync_pattern == SYNC_NO_PATTERN) {
+		sync_send(SYNC_FRAME);
+	}
+#elif SYNC_ROLE == SYNC_ROLE_SLAVE
+	sync_frame = 0;
+#endif
+
+#ifdef STACK_PROFILE
+	stack_paint();
+#endif
+
+	// Fading a frame only needs its colours
+	if (fading) {
+		uint8_t num_colours;
+		struct RGB *colours = frame_colours(led_data, frame_flags, &num_colours);
+		pattern_status = pf.run_pattern(colours, num_colours, pattern_status, pf.extra_parameter, &render_wait);
+	} else {
+		pattern_status = pf.run_pattern(led_data, NUM_LEDS, pattern_status, pf.extra_parameter, &render_wait);
+	}
+
+#if SENSORS_ENABLE
+	// Fewer frames and less light on low battery or in the dark.
+	// Patterns keep their speed, as they go by the clock
+	if (render_wait < sensors_frame_ms) {
+		render_wait = sensors_frame_ms;
+	}
+	ws2812_dim = sensors_dim;
+#endif
+
+	// A wait forever is as far ahead as the clock can tell
+	task->wake = now + (render_wait == PATTERN_WAIT_FOREVER ? TASK_FOREVER : render_wait);
+
+#if SYNC_ROLE == SYNC_ROLE_SLAVE
+	// While the master is heard, its frame pulses start the frames, and
+	// the own wait only stands in for a pulse that does not come
+	if (render_wait != PATTERN_WAIT_FOREVER) {
+		cli();
+		if (sync_lock_count) {
+			task->wake += SYNC_FRAME_SLACK_MS;
+		}
+		sei();
+	}
+#endif
+
+	// Check status
+	switch (pattern_status) {
+
+		case PATTERN_STATUS_REFRESH:
+
+			frame_ready = 1;
+			break;
+
+		case PATTERN_STATUS_FADE_DONE:
+
+			// Next pattern may draw the other kind of frame: start from black
+			memset(led_data, 0, FRAMEBUFFER_BYTES);
+			fading = 0;
+			pattern_status = PATTERN_STATUS_NEW;
+			task->wake = now;
+			break;
+
+	}
+
+#ifdef STACK_PROFILE
+	stack_record();
+#endif
+
+}
+
+#if SENSORS_ENABLE
+static void sensors_run(struct task *task, uint16_t now)
+{
+
+	TASK_BEGIN(task);
+
+	// Measure now and then. The results come in from the ADC interrupt
+	while (1) {
+		sensors_start();
+		TASK_SLEEP(task, now, SENSORS_PERIOD_MS);
+	}
+
+	TASK_END(task);
+
+}
+#endif
+
+/******************************************************************
+ * Main 
+ ******************************************************************/
+
+int main(void)
+{
+
+	init_IO();
+	ws2812_calibration_load();
+	init_system_timer();
+	init_button_interrupt();
+#if SYNC_ROLE != SYNC_ROLE_NONE
+	init_sync();
+#endif
+	sei();
+
+	srand(42);
+
+	while (1) {
+
+		uint16_t deadline = tasks_run(tasks, NUM_TASKS, get_ms_clock);
+
+		// Nothing will change until the button is pressed: power down.
+		// While a press is debounced, idle until the next debounce
+		// slice. Otherwise idle until the next task is due
+		if (!fading && !demo_mode && !num_active_layers && !overlay_shown
+				&& render_wait == PATTERN_WAIT_FOREVER && pattern_status != PATTERN_STATUS_NEW) {
+			uint16_t slice_end = get_ms_clock() + SLICE_MS - slice_ms;
+			if (sleep_until_button()) {
+				tasks[TASK_RENDER].wake = get_ms_clock();
+			} else {
+				sleep_until((int16_t) (deadline - slice_end) < 0 ? deadline : slice_end);
+			}
+		} else {
+			sleep_until(deadline);
+		}
 
 	}
 
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include "stack.h"
+
+#ifdef STACK_PROFILE
+
+/********************************************************************************
+ * Stack painting
+ *
+ * All RAM between the end of the static data (__heap_start, there is no heap)
+ * and the stack pointer is filled with STACK_PAINT. The stack grows down into
+ * it, so the first byte from the bottom that is not STACK_PAINT any more is
+ * the deepest the stack has been. A stack byte that happens to hold
+ * STACK_PAINT makes the result a byte or two short, no more.
+ *
+ * Interrupts can come in while RAM is painted or checked. That is harmless:
+ * they only use RAM below the stack pointer of the code they interrupt.
+ ********************************************************************************/
+
+#define STACK_MARGIN	8		// Bytes left unpainted below the caller
+
+extern uint8_t __heap_start;
+
+/************************************************************
+ * paint: fill a stretch of RAM with STACK_PAINT
+ *	Params:
+ *		uint8_t *	first byte
+ *		uint8_t *	byte after the last one
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static void paint(uint8_t *from, uint8_t *to)
+{
+
+	while (from < to) {
+		*from++ = STACK_PAINT;
+	}
+
+}
+
+/************************************************************
+ * depth: stack depth, going by the paint
+ *	Params:
+ *		uint8_t *	lowest painted byte
+ *	Returns:
+ *		uint16_t	bytes from the top of RAM
+ ************************************************************/
+
+static uint16_t depth(uint8_t *from)
+{
+
+	while (from <= (uint8_t *) RAMEND && *from == STACK_PAINT) {
+		from++;
+	}
+
+	return (uint8_t *) RAMEND + 1 - from;
+
+}
+
+extern void stack_paint(void)
+{
+
+	paint(&__heap_start, (uint8_t *) SP - STACK_MARGIN);
+
+}
+
+extern uint16_t stack_used(void)
+{
+
+	return depth(&__heap_start);
+
+}
+
+/************************************************************
+ * stack_isr_begin: paint the RAM below an ISR
+ *	Params:
+ *		uint16_t *		deepest stack seen in the ISR
+ *	Returns:
+ *		struct stack_mark	to hand to stack_isr_end
+ ************************************************************/
+
+extern struct stack_mark stack_isr_begin(uint16_t *max)
+{
+
+	struct stack_mark mark;
+	uint8_t *sp = (uint8_t *) SP;
+
+	mark.max = max;
+	mark.bottom = sp - STACK_ISR_WINDOW;
+
+	if (mark.bottom < &__heap_start) {
+		mark.bottom = &__heap_start;
+	}
+
+	// Not up to sp: paint is a call, and its own frame is down there
+	paint(mark.bottom, sp - STACK_MARGIN);
+
+	return mark;
+
+}
+
+/************************************************************
+ * stack_isr_end: record how deep an ISR went
+ *	Params:
+ *		struct stack_mark *	from stack_isr_begin
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void stack_isr_end(struct stack_mark *mark)
+{
+
+	uint16_t used = depth(mark->bottom);
+
+	if (used > *mark->max) {
+		*mark->max = used;
+	}
+
+}
+
+#endif
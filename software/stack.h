@@ -0,0 +1,73 @@
+/************************************************
+ * stack.h
+ *
+ * Stack use measurement
+ ************************************************/
+
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * Build with -DSTACK_PROFILE to measure how deep the stack
+ * goes. Free RAM is painted with a known byte, and whatever is
+ * no longer that byte afterwards has been used. The results
+ * stay in RAM, to be read with a debugger or a simulator.
+ ************************************************************/
+
+#define STACK_PAINT			0xc5	// Byte free RAM is painted with
+#define STACK_ISR_WINDOW	64		// Bytes painted below an ISR
+
+/* Public interface */
+
+/************************************************************
+ * stack_paint: paint all free RAM below the stack
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void stack_paint(void);
+
+/************************************************************
+ * stack_used: deepest stack since the last stack_paint
+ *	Params:
+ *		none
+ *	Returns:
+ *		uint16_t	bytes from the top of RAM
+ ************************************************************/
+
+extern uint16_t stack_used(void);
+
+/************************************************************
+ * STACK_ISR: measure an interrupt routine
+ *	Params:
+ *		uint16_t	deepest stack seen in the ISR, updated
+ *
+ * Put at the start of the ISR. It paints STACK_ISR_WINDOW
+ * bytes below the ISR, and checks them whenever the ISR
+ * returns (it is a cleanup variable, so early returns are
+ * covered). The result counts from the top of RAM, so it
+ * includes the stack of whatever the ISR interrupted, and
+ * a few bytes for the check itself.
+ ************************************************************/
+
+struct stack_mark {
+	uint8_t *bottom;	// Lowest painted byte
+	uint16_t *max;		// Deepest stack seen
+};
+
+extern struct stack_mark stack_isr_begin(uint16_t *);
+extern void stack_isr_end(struct stack_mark *);
+
+#ifdef STACK_PROFILE
+#define STACK_ISR(max)	struct stack_mark stack_mark __attribute__((cleanup(stack_isr_end))) = stack_isr_begin(&(max))
+#else
+#define STACK_ISR(max)
+#endif
+
+#endif
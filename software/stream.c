@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include "ws2812.h"
+#include "stream.h"
+
+#if STREAM_ENABLE
+
+/********************************************************************************
+ * Serial receiver
+ *
+ * The UART is bit-banged in the INT0 interrupt: the falling edge of the start
+ * bit starts it, and it reads the eight data bits in the middle of each bit
+ * time. That blocks interrupts for nine and a half bit times, 165us at 57600
+ * baud, which the 1ms timer interrupt waits out. It also means the timer
+ * interrupt can hold up the start of a byte, so the baud rate has to leave it
+ * half a bit: 173 cycles at 57600 baud and 20MHz.
+ *
+ * The bytes go straight where they belong in the frame buffer, there is no
+ * receive buffer and nothing is copied. So from the start of a packet the
+ * frame buffer is not fit to show, and stream_hold is set until a good
+ * checksum ends the packet: the LEDs keep the last good frame meanwhile. A
+ * bad or cut off packet leaves the frame buffer part old and part new, and a
+ * delta is only good on top of the frame it was made for, so after one the
+ * LEDs hold until the next good keyframe (the host sends one at least every
+ * 32 frames). The same goes for a delta that has to be dropped because the
+ * last frame has not gone out yet (stream_ready): the frame buffer is left
+ * alone from a good packet until its frame has been sent.
+ *
+ * send_frame keeps interrupts off, so the host has to leave the line quiet
+ * while a frame goes out: the STREAM_GAP_MS it leaves between packets anyway
+ * is enough for 18 LEDs.
+ *
+ * Build with -DSTREAM_PROFILE to count the packets.
+ ********************************************************************************/
+
+#define STREAM_BIT_US		(1000000.0 / STREAM_BAUD)
+#define STREAM_ENTRY_US		(32 * 1000000.0 / F_CPU)	// Interrupt response and prologue
+#define STREAM_LOOP_US		(8 * 1000000.0 / F_CPU)		// Reading a bit and the loop
+
+enum {
+	STREAM_HEADER,
+	STREAM_COUNT,
+	STREAM_INDEX,
+	STREAM_DATA,
+	STREAM_CHECKSUM,
+	STREAM_SKIP,
+};
+
+volatile uint8_t stream_ready = 0;
+volatile uint8_t stream_hold = 0;
+
+#ifdef STREAM_PROFILE
+volatile uint16_t stream_frames = 0;
+volatile uint16_t stream_errors = 0;
+volatile uint8_t stream_fps = 0;
+
+static uint8_t second_frames;
+static uint16_t second_start;
+#endif
+
+static uint8_t *buffer;
+static uint8_t num_leds;
+static uint8_t synced;			// Frame buffer holds the frame the host sent last
+static uint8_t base;			// synced before this packet, which a delta keeps
+static uint8_t state;
+static uint8_t *write;
+static uint8_t left;			// Bytes to go of the LED or keyframe
+static uint8_t count;			// LEDs to go of the delta
+static uint8_t sum;
+static uint16_t last;			// ms clock at the last byte
+
+extern void stream_start(struct RGB *data, uint8_t leds)
+{
+
+	buffer = (uint8_t *) data;
+	num_leds = leds;
+	state = STREAM_HEADER;
+	synced = 0;
+	stream_ready = 0;
+	stream_hold = 0;
+
+	// Input with pull-up, so an unconnected line is idle
+	DDRB &= ~(1 << STREAM_PIN);
+	PORTB |= (1 << STREAM_PIN);
+
+	MCUCR = (MCUCR & ~(1 << ISC00)) | (1 << ISC01);		// Falling edge
+	GIFR = (1 << INTF0);
+	GIMSK |= (1 << INT0);
+
+}
+
+extern void stream_stop(void)
+{
+
+	GIMSK &= ~(1 << INT0);
+	stream_ready = 0;
+	stream_hold = 0;
+
+}
+
+/************************************************************
+ * stream_byte: take a byte into the packet
+ *	Params:
+ *		uint8_t			byte
+ *		uint16_t		ms clock
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static void stream_byte(uint8_t byte, uint16_t now)
+{
+
+	if ((uint16_t) (now - last) >= STREAM_GAP_MS) {
+		state = STREAM_HEADER;
+	}
+	last = now;
+
+	switch (state) {
+
+		case STREAM_HEADER:
+
+			sum = 0;
+			count = 1;
+
+			if (byte != STREAM_KEYFRAME && byte != STREAM_DELTA) {
+				state = STREAM_SKIP;
+				break;
+			}
+
+			if (stream_ready) {
+				// Dropped. Without this delta, the ones after it are wrong
+				if (byte == STREAM_DELTA) {
+					synced = 0;
+				}
+				state = STREAM_SKIP;
+				break;
+			}
+
+			base = (byte == STREAM_KEYFRAME) || synced;
+			synced = 0;
+			stream_hold = 1;
+
+			if (byte == STREAM_KEYFRAME) {
+				write = buffer;
+				left = num_leds * WS2812_BYTES_PER_LED;
+				state = STREAM_DATA;
+			} else {
+				state = STREAM_COUNT;
+			}
+			break;
+
+		case STREAM_COUNT:
+
+			count = byte;
+			state = count ? STREAM_INDEX : STREAM_CHECKSUM;
+			break;
+
+		case STREAM_INDEX:
+
+			if (byte < num_leds) {
+				write = buffer + byte * WS2812_BYTES_PER_LED;
+				left = WS2812_BYTES_PER_LED;
+				state = STREAM_DATA;
+			} else {
+				state = STREAM_SKIP;
+			}
+			break;
+
+		case STREAM_DATA:
+
+			*write++ = byte;
+			if (--left == 0) {
+				state = --count ? STREAM_INDEX : STREAM_CHECKSUM;
+			}
+			break;
+
+		case STREAM_CHECKSUM:
+
+			if (byte == sum) {
+				synced = base;
+				stream_hold = !synced;
+				stream_ready = synced;
+			}
+			state = STREAM_SKIP;
+
+#ifdef STREAM_PROFILE
+			if (byte == sum) {
+				stream_frames++;
+				second_frames++;
+			} else {
+				stream_errors++;
+			}
+			if ((uint16_t) (now - second_start) >= 1000) {
+				stream_fps = second_frames;
+				second_frames = 0;
+				second_start = now;
+			}
+#endif
+			break;
+
+	}
+
+	sum += byte;
+
+}
+
+extern void stream_receive(uint16_t now)
+{
+
+	uint8_t byte = 0;
+	uint8_t bit;
+
+	// To the middle of the first data bit
+	_delay_us(STREAM_BIT_US * 3 / 2 - STREAM_ENTRY_US);
+
+	for (bit = 0; bit < 8; bit++) {
+		byte >>= 1;
+		if (bit_is_set(PINB, STREAM_PIN)) {
+			byte |= 0x80;
+		}
+		_delay_us(STREAM_BIT_US - STREAM_LOOP_US);
+	}
+
+	// Middle of the stop bit. The falling edges in the data bits
+	// are not start bits
+	GIFR = (1 << INTF0);
+
+	stream_byte(byte, now);
+
+}
+
+#endif
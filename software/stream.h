@@ -0,0 +1,111 @@
+/************************************************
+ * stream.h
+ *
+ * Live frames from a host over a serial line
+ ************************************************/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include "ws2812.h"
+
+/************************************************************
+ * Build time configuration
+ *
+ * The host sends frames as 8N1 serial data, TTL level, to the
+ * INT0 pin (PB2), which is free unless the sync line is used.
+ * Build with -DSTREAM_ENABLE=1 to get the stream pattern, and
+ * send with tools/stream_frames.py.
+ *
+ * Packets, each followed by a checksum byte (the sum of all
+ * bytes before it, modulo 256):
+ *
+ *	'K', bytes of all LEDs						keyframe
+ *	'D', n, n times (LED, bytes of that LED)	delta
+ *
+ * The bytes of an LED are in the order of struct RGB, so they
+ * go straight into the frame buffer. A packet starts after the
+ * line has been quiet for STREAM_GAP_MS: that is how the
+ * receiver finds the start again after a bad packet.
+ ************************************************************/
+
+#ifndef STREAM_ENABLE
+#define STREAM_ENABLE	0
+#endif
+
+#ifndef STREAM_BAUD
+#define STREAM_BAUD		57600
+#endif
+
+#define STREAM_PIN		PB2		// INT0
+#define STREAM_GAP_MS	2		// Quiet time before a packet
+
+#define STREAM_KEYFRAME	'K'
+#define STREAM_DELTA	'D'
+
+/* Public interface */
+
+/************************************************************
+ * stream_ready: a good packet is in the frame buffer
+ *
+ * Set by the receiver, cleared once the frame has gone out to
+ * the LEDs. Packets that come in while it is set are dropped,
+ * so the frame buffer does not change between the two.
+ ************************************************************/
+
+extern volatile uint8_t stream_ready;
+
+/************************************************************
+ * stream_hold: the frame buffer is not fit to show
+ *
+ * Set while a packet is written into it, and after a bad one
+ * until the next good keyframe. The LEDs keep the last good
+ * frame meanwhile: nothing is to be sent from the frame buffer.
+ ************************************************************/
+
+extern volatile uint8_t stream_hold;
+
+/************************************************************
+ * stream_start: start receiving
+ *	Params:
+ *		struct RGB *	frame buffer to receive into
+ *		uint8_t			number of LEDs
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void stream_start(struct RGB *, uint8_t);
+
+/************************************************************
+ * stream_stop: stop receiving
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void stream_stop(void);
+
+/************************************************************
+ * stream_receive: read a byte from the line
+ *	Params:
+ *		uint16_t		ms clock
+ *	Returns:
+ *		void
+ *
+ * Called from the INT0 interrupt, at the falling edge of the
+ * start bit. Returns half way through the stop bit.
+ ************************************************************/
+
+extern void stream_receive(uint16_t);
+
+#ifdef STREAM_PROFILE
+/* Packets received, good and bad, and good packets in the last
+ * whole second */
+extern volatile uint16_t stream_frames;
+extern volatile uint16_t stream_errors;
+extern volatile uint8_t stream_fps;
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/************************************************
+ * sync.h
+ *
+ * Pulse code of the sync line between snowflakes
+ ************************************************/
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * The master pulls the line low for a whole number of ms,
+ * timed by its ms clock, and the slaves time the pulse with
+ * theirs. A pulse set going between two ticks is short by up
+ * to a ms, and either end can be held up by 0.6ms while the
+ * sender or the receiver has interrupts off (send_frame), so a
+ * pulse of n ms is read as anything from n - 2 to n + 2. The
+ * pulse lengths are 5ms apart to cover that. The clocks have to
+ * agree to well within 1% for the longest pulses, which the
+ * crystal does but the RC oscillator (FUSES_PLL) may not.
+ *
+ * Without a gap after a pulse, the frame pulse that follows a
+ * pattern change at once would run into it for a receiver that
+ * has interrupts off at the time.
+ *
+ * A pattern pulse and the gap have to fit in a uint8_t, so
+ * there can be up to 50 patterns. It is plain C on integers, so
+ * tests/sync_test.c can run a master and a slave on the host.
+ ************************************************************/
+
+#define SYNC_GAP_MS				2						// Line high at least this long after a pulse
+#define SYNC_FRAME_PULSE_MS		2						// Pulse at the start of every frame
+#define SYNC_FRAME_MAX_MS		4						// Longest pulse read as a frame pulse
+#define SYNC_PULSE_STEP_MS		5
+#define SYNC_PULSE_MS(pattern)	(SYNC_FRAME_MAX_MS + 3 + SYNC_PULSE_STEP_MS * (pattern))	// Pulse announcing a pattern
+
+#define SYNC_FRAME			0xfe	// Pulse was a frame pulse
+#define SYNC_NO_PATTERN		0xff	// Pulse was no pulse of ours
+
+/* Public interface */
+
+/************************************************************
+ * sync_decode: what a pulse means
+ *	Params:
+ *		uint16_t	length as timed by the receiver, in ms
+ *	Returns:
+ *		uint8_t		pattern, SYNC_FRAME or SYNC_NO_PATTERN
+ *
+ * The caller still has to check the pattern number against
+ * the number of patterns it has.
+ ************************************************************/
+
+static inline uint8_t sync_decode(uint16_t pulse_ms)
+{
+
+	uint16_t pattern;
+
+	if (pulse_ms <= SYNC_FRAME_MAX_MS) {
+		return SYNC_FRAME;
+	}
+
+	pattern = (pulse_ms - SYNC_FRAME_MAX_MS - 1) / SYNC_PULSE_STEP_MS;
+
+	return pattern < SYNC_FRAME ? pattern : SYNC_NO_PATTERN;
+
+}
+
+#endif
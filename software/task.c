@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "task.h"
+
+/********************************************************************************
+ * Scheduler
+ *
+ * The tasks are checked in order, and the first one that is due runs one step.
+ * Then the checking starts from the top again. With 4 tasks a check costs well
+ * under 100 cycles, so the main loop can afford to run it after every step.
+ *
+ * With TASK_PROFILE, a run is timed from the ms clock and Timer0, which counts
+ * up to OCR0A once per ms. A run that takes longer than 65535 counts (0.84
+ * seconds at 20MHz) is recorded wrongly, which is not a worry.
+ ********************************************************************************/
+
+#ifdef TASK_TICKS
+
+/************************************************************
+ * task_ticks: ms clock and Timer0 together
+ *	Params:
+ *		uint16_t (*)(void)	ms clock, must leave interrupts
+ *							as they were
+ *	Returns:
+ *		uint16_t			Timer0 counts
+ *
+ * Both are read with interrupts off. Timer0 may still have
+ * wrapped before its interrupt could count the ms: then the
+ * compare flag is set and the count has started again from 0.
+ * If the flag is set with a high count, the wrap came after
+ * the count was read.
+ ************************************************************/
+
+extern uint16_t task_ticks(uint16_t (*clock)(void))
+{
+
+	uint8_t sreg = SREG;
+	uint16_t ms;
+	uint8_t count;
+
+	cli();
+	ms = clock();
+	count = TCNT0;
+	if ((TIFR & (1 << OCF0A)) && count < OCR0A / 2) {
+		ms++;
+	}
+	SREG = sreg;
+
+	return ms * (OCR0A + 1) + count;
+
+}
+
+#endif
+
+extern uint16_t tasks_run(struct task *tasks, uint8_t num_tasks, uint16_t (*clock)(void))
+{
+
+	struct task *task;
+	uint16_t now;
+	uint16_t next;
+
+	do {
+
+		now = clock();
+		next = now + TASK_FOREVER;
+
+		for (task = tasks; task < tasks + num_tasks; task++) {
+
+			if ((int16_t) (now - task->wake) >= 0 || (task->pending && task->pending())) {
+				break;
+			}
+
+			if ((int16_t) (task->wake - next) < 0) {
+				next = task->wake;
+			}
+
+		}
+
+		if (task < tasks + num_tasks) {
+
+#ifdef TASK_PROFILE
+			uint16_t start = task_ticks(clock);
+#endif
+
+			task->wake = now;
+			task->run(task, now);
+			task->runs++;
+
+#ifdef TASK_PROFILE
+			uint16_t used = task_ticks(clock) - start;
+			task->total_ticks += used;
+			if (used > task->max_ticks) {
+				task->max_ticks = used;
+			}
+#endif
+
+		}
+
+	} while (task < tasks + num_tasks);
+
+	return next;
+
+}
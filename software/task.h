@@ -0,0 +1,122 @@
+/************************************************
+ * task.h
+ *
+ * Cooperative task scheduler
+ ************************************************/
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * Tasks are plain functions that do one short step and
+ * return. There are no stacks per task: a task that has to
+ * wait in the middle of something keeps its place with the
+ * TASK_ macros below (protothreads, after Adam Dunkels), so
+ * its local variables do not survive a wait.
+ *
+ * Every task counts its runs. Build with -DTASK_PROFILE to
+ * also measure how long they take, in Timer0 counts (256
+ * cycles each, with Timer0 as the 1ms system tick).
+ ************************************************************/
+
+#define TASK_FOREVER		INT16_MAX	// As far ahead as the ms clock can tell
+
+/* Profile builds that time code with task_ticks */
+#if defined(TASK_PROFILE) || defined(PARTICLES_PROFILE) || defined(NOISE_PROFILE)
+#define TASK_TICKS
+#endif
+
+/* Public interface */
+
+/************************************************************
+ * struct task: a task
+ *
+ * A task is due when the ms clock has reached wake, or when
+ * its pending function returns non-zero. The run function
+ * sets wake for the next time; if it does not, the task is
+ * due again at once.
+ ************************************************************/
+
+struct task {
+	void (*run)(struct task *, uint16_t);		// One step, gets the ms clock
+	uint8_t (*pending)(void);					// Events that make it due, or NULL
+	uint16_t wake;								// ms clock at which it is due
+	uint16_t line;								// Where a TASK_BEGIN task goes on
+	uint16_t runs;								// Number of runs, wraps
+#ifdef TASK_PROFILE
+	uint16_t max_ticks;							// Longest run
+	uint32_t total_ticks;						// All runs together
+#endif
+};
+
+/************************************************************
+ * Protothread macros
+ *
+ *	TASK_BEGIN(task)				start of the run function
+ *	TASK_SLEEP(task, now, ms)		come back in ms
+ *	TASK_WAIT(task, now, condition)	check again every ms until
+ *									condition holds
+ *	TASK_END(task)					end of the run function
+ *
+ * The run function is one switch statement, so TASK_SLEEP and
+ * TASK_WAIT may not be used inside another switch.
+ ************************************************************/
+
+#define TASK_BEGIN(task)			switch ((task)->line) { case 0:
+
+#define TASK_SLEEP(task, now, ms)	do { \
+		(task)->wake = (now) + (ms); \
+		(task)->line = __LINE__; \
+		return; \
+		case __LINE__:; \
+	} while (0)
+
+#define TASK_WAIT(task, now, condition)	do { \
+		(task)->line = __LINE__; \
+		case __LINE__: \
+		if (!(condition)) { \
+			(task)->wake = (now) + 1; \
+			return; \
+		} \
+	} while (0)
+
+#define TASK_END(task)				} (task)->line = 0
+
+/************************************************************
+ * tasks_run: run tasks until none is due
+ *	Params:
+ *		struct task *		tasks, highest priority first
+ *		uint8_t				number of tasks
+ *		uint16_t (*)(void)	ms clock
+ *	Returns:
+ *		uint16_t			ms clock at which the next task is due
+ *
+ * After every run the tasks are checked from the top again,
+ * so a task that gets due always goes before the ones below
+ * it. A task that is always due starves the ones below.
+ ************************************************************/
+
+extern uint16_t tasks_run(struct task *, uint8_t, uint16_t (*)(void));
+
+#ifdef TASK_TICKS
+/************************************************************
+ * task_ticks: ms clock and Timer0 together
+ *	Params:
+ *		uint16_t (*)(void)	ms clock, must leave interrupts
+ *							as they were
+ *	Returns:
+ *		uint16_t			Timer0 counts, 256 cycles each
+ *
+ * The difference of two calls times the code in between, up
+ * to 65535 counts (0.84s at 20MHz). Timer0 is the system
+ * tick, so unlike Timer1 it is there in every build.
+ ************************************************************/
+
+extern uint16_t task_ticks(uint16_t (*)(void));
+#endif
+
+#endif
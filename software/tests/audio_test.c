@@ -0,0 +1,299 @@
+/********************************************************************************
+ * audio_test.c
+ *
+ * Runs the band filters of audio.c on the host: audio.c is built against the
+ * registers in tests/avr/io.h, and ADCH is fed conversions as the free running
+ * ADC would at 16MHz, the PLL clock the audio input needs (AUDIO_SAMPLE_RATE,
+ * 2404Hz after averaging).
+ *
+ * Sweeps a full scale sine from 50Hz to 1.15kHz and prints the three levels,
+ * then checks that
+ *
+ *	- silence, at any bias, gives levels of 0 in all bands,
+ *	- a full scale sine in the middle of a band gives about 192 there, and
+ *	  well under half of that in the other two bands,
+ *	- levels rise within a block and decay over a few blocks.
+ *
+ * Recordings can be given as arguments, as WAV files (PCM, 8 or 16 bits, any
+ * rate, the first channel), each with the band it should light up most:
+ *
+ *	bass:samples/kick.wav
+ *
+ * A file is resampled to the conversion rate, full scale to the full ADC
+ * range, and fed through from the start. The mean and peak level of each band
+ * over the file are printed, and the named band has to have the highest mean.
+ * A file without a band is only reported.
+ ********************************************************************************/
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "audio.h"
+
+#define CONVERSION_RATE		(AUDIO_SAMPLE_RATE * AUDIO_DECIMATE)
+#define SETTLE_BLOCKS		8
+#define BAND_LOW			150		// Level of a full scale sine in its band, at least
+#define BAND_HIGH			230		// and at most
+#define OTHER_HIGH			96		// Level in the other bands, at most
+
+uint8_t ADCH, ADCSRA, ADCSRB, ADMUX, DIDR0, PORTB, TCCR1, TCNT1;
+
+static const char *band_names[AUDIO_BANDS] = { "bass", "mid", "high" };
+static const double band_hz[AUDIO_BANDS] = {
+	AUDIO_SAMPLE_RATE / 24.0,
+	AUDIO_SAMPLE_RATE / 6.0,
+	AUDIO_SAMPLE_RATE / 3.0,
+};
+
+static unsigned long conversion;
+static int failures;
+
+/* Feed blocks of a sine of amplitude (0 - 127) around bias */
+static void feed(double hz, double amplitude, double bias, uint8_t blocks)
+{
+
+	uint32_t i;
+
+	for (i = 0; i < (uint32_t) blocks * AUDIO_BLOCK * AUDIO_DECIMATE; i++) {
+		ADCH = (uint8_t) lround(bias + amplitude * sin(2 * M_PI * hz * conversion / CONVERSION_RATE));
+		conversion++;
+		audio_sample();
+	}
+
+}
+
+static void restart(void)
+{
+
+	audio_stop();
+	audio_start();
+	conversion = 0;
+
+}
+
+static void expect(int ok, const char *what, double hz, uint8_t band)
+{
+
+	if (!ok) {
+		printf("FAIL: %s, %.0fHz, %s band at %u\n", what, hz, band_names[band], audio_levels[band]);
+		failures++;
+	}
+
+}
+
+static uint32_t read_le(const uint8_t *bytes, uint8_t length)
+{
+
+	uint32_t value = 0;
+
+	while (length--) {
+		value = (value << 8) | bytes[length];
+	}
+
+	return value;
+
+}
+
+/* Samples of the first channel of a WAV file, -1 to 1. Returns the number */
+static uint32_t read_wav(const char *path, double **samples, uint32_t *rate)
+{
+
+	FILE *file = fopen(path, "rb");
+	uint8_t header[12], chunk[8], format[16];
+	uint16_t channels = 0, bits = 0;
+	uint32_t length, i, frame, count = 0;
+	uint8_t *data;
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	if (fread(header, 1, 12, file) != 12 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+		printf("%s: not a WAV file\n", path);
+		fclose(file);
+		return 0;
+	}
+
+	while (fread(chunk, 1, 8, file) == 8) {
+
+		length = read_le(chunk + 4, 4);
+
+		if (!memcmp(chunk, "fmt ", 4) && length >= 16) {
+			if (fread(format, 1, 16, file) != 16) {
+				break;
+			}
+			fseek(file, length - 16 + (length & 1), SEEK_CUR);
+			channels = read_le(format + 2, 2);
+			*rate = read_le(format + 4, 4);
+			bits = read_le(format + 14, 2);
+			if (read_le(format, 2) != 1 || (bits != 8 && bits != 16) || channels == 0) {
+				printf("%s: only PCM with 8 or 16 bits\n", path);
+				break;
+			}
+		} else if (!memcmp(chunk, "data", 4) && bits) {
+			frame = channels * bits / 8;
+			data = malloc(length);
+			count = fread(data, 1, length, file) / frame;
+			*samples = malloc(count * sizeof(double));
+			for (i = 0; i < count; i++) {
+				if (bits == 8) {
+					(*samples)[i] = (data[i * frame] - 128) / 128.0;
+				} else {
+					(*samples)[i] = (int16_t) read_le(data + i * frame, 2) / 32768.0;
+				}
+			}
+			free(data);
+			break;
+		} else {
+			fseek(file, length + (length & 1), SEEK_CUR);
+		}
+
+	}
+
+	fclose(file);
+
+	if (count == 0) {
+		printf("%s: no samples\n", path);
+	}
+
+	return count;
+
+}
+
+/* Feeds a recording through, as "band:path" or "path" */
+static void check_file(const char *arg)
+{
+
+	const char *path = arg;
+	const char *colon = strchr(arg, ':');
+	int8_t expect = -1;
+	double *samples = NULL;
+	uint32_t rate = 0, count, blocks = 0;
+	uint32_t sum[AUDIO_BANDS] = { 0 };
+	uint8_t peak[AUDIO_BANDS] = { 0 };
+	uint8_t band, best = 0;
+	double at, step, value;
+
+	if (colon) {
+		for (band = 0; band < AUDIO_BANDS; band++) {
+			if ((size_t) (colon - arg) == strlen(band_names[band]) && !strncmp(arg, band_names[band], colon - arg)) {
+				expect = band;
+			}
+		}
+		if (expect < 0) {
+			printf("FAIL: %s: no such band\n", arg);
+			failures++;
+			return;
+		}
+		path = colon + 1;
+	}
+
+	count = read_wav(path, &samples, &rate);
+	if (count == 0) {
+		failures++;
+		return;
+	}
+
+	restart();
+	step = (double) rate / CONVERSION_RATE;
+
+	for (at = 0; at < count - 1; at += step) {
+
+		value = samples[(uint32_t) at] + (samples[(uint32_t) at + 1] - samples[(uint32_t) at]) * (at - (uint32_t) at);
+		ADCH = (uint8_t) lround(127.5 + 127.5 * (value > 1 ? 1 : value < -1 ? -1 : value));
+		conversion++;
+		audio_sample();
+
+		if (conversion % (AUDIO_BLOCK * AUDIO_DECIMATE) == 0) {
+			for (band = 0; band < AUDIO_BANDS; band++) {
+				sum[band] += audio_levels[band];
+				if (audio_levels[band] > peak[band]) {
+					peak[band] = audio_levels[band];
+				}
+			}
+			blocks++;
+		}
+
+	}
+
+	free(samples);
+
+	printf("%s: %.2fs at %uHz\n", path, (double) count / rate, rate);
+	for (band = 0; band < AUDIO_BANDS; band++) {
+		printf("  %-5s mean %5.1f  peak %3u\n", band_names[band], blocks ? (double) sum[band] / blocks : 0.0, peak[band]);
+		if (sum[band] > sum[best]) {
+			best = band;
+		}
+	}
+
+	if (expect >= 0 && best != expect) {
+		printf("FAIL: %s, %s band should be highest\n", path, band_names[expect]);
+		failures++;
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+
+	uint8_t band, other;
+	uint16_t bias;
+	uint8_t before;
+	double hz;
+	int arg;
+
+	printf("%6s %6s %6s %6s\n", "Hz", band_names[0], band_names[1], band_names[2]);
+	for (hz = 50; hz <= 1150; hz += 50) {
+		restart();
+		feed(hz, 127, 128, SETTLE_BLOCKS);
+		printf("%6.0f %6u %6u %6u\n", hz, audio_levels[0], audio_levels[1], audio_levels[2]);
+	}
+
+	// Silence, after the bias tracker has settled
+	for (bias = 64; bias <= 192; bias += 64) {
+		restart();
+		feed(0, 0, bias, 32);
+		for (band = 0; band < AUDIO_BANDS; band++) {
+			expect(audio_levels[band] == 0, "silence", 0, band);
+		}
+	}
+
+	for (band = 0; band < AUDIO_BANDS; band++) {
+
+		restart();
+		feed(band_hz[band], 127, 128, SETTLE_BLOCKS);
+		expect(audio_levels[band] >= BAND_LOW && audio_levels[band] <= BAND_HIGH, "level in band", band_hz[band], band);
+		for (other = 0; other < AUDIO_BANDS; other++) {
+			if (other != band) {
+				expect(audio_levels[other] <= OTHER_HIGH, "level outside band", band_hz[band], other);
+			}
+		}
+
+		// Rises at once
+		restart();
+		feed(0, 0, 128, 4);
+		feed(band_hz[band], 127, 128, 2);
+		expect(audio_levels[band] >= BAND_LOW, "rise within a block", band_hz[band], band);
+
+		// Decays, but not at once
+		before = audio_levels[band];
+		feed(0, 0, 128, 1);
+		expect(audio_levels[band] < before && audio_levels[band] > before / 2, "decay over a block", band_hz[band], band);
+		feed(0, 0, 128, 32);
+		expect(audio_levels[band] == 0, "decay to 0", band_hz[band], band);
+
+	}
+
+	for (arg = 1; arg < argc; arg++) {
+		check_file(argv[arg]);
+	}
+
+	printf(failures ? "FAIL\n" : "PASS\n");
+
+	return failures != 0;
+
+}
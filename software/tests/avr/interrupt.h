@@ -0,0 +1,9 @@
+/* avr/interrupt.h for the host tests: nothing runs in interrupts here */
+
+#ifndef TESTS_AVR_INTERRUPT_H
+#define TESTS_AVR_INTERRUPT_H
+
+#define sei()
+#define cli()
+
+#endif
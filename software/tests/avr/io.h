@@ -0,0 +1,37 @@
+/********************************************************************************
+ * avr/io.h for the host tests
+ *
+ * The registers the modules under test touch, as plain variables, so that a
+ * test can feed ADCH and look at the rest. Defined in the tests that use them.
+ ********************************************************************************/
+
+#ifndef TESTS_AVR_IO_H
+#define TESTS_AVR_IO_H
+
+#include <stdint.h>
+
+extern uint8_t ADCH, ADCSRA, ADCSRB, ADMUX, DIDR0, PORTB, TCCR1, TCNT1;
+extern uint8_t DDRB, PINB, MCUCR, GIFR, GIMSK;
+
+#define ADPS0	0
+#define ADPS1	1
+#define ADPS2	2
+#define ADIE	3
+#define ADATE	5
+#define ADSC	6
+#define ADEN	7
+#define ADLAR	5
+#define ADC2D	4
+#define ADC3D	3
+#define PB3		3
+#define PB4		4
+#define CS12	2
+#define PB2		2
+#define ISC00	0
+#define ISC01	1
+#define INTF0	6
+#define INT0	6
+
+#define bit_is_set(reg, bit)	((reg) & (1 << (bit)))
+
+#endif
@@ -0,0 +1,353 @@
+/********************************************************************************
+ * button_test.c
+ *
+ * Replays button traces through the gesture detector in button.h, the way the
+ * firmware drives it: the pin change interrupt starts a push on the first
+ * falling edge and is then off, the timer feeds a sample every 10ms slice, and
+ * the pin change interrupt comes back on once the push is over.
+ *
+ * The traces are synthetic, from a seeded model of contact bounce: bursts of
+ * up to 6 edges, 0.1 to 1.5ms apart, when the button is pushed and let go,
+ * around taps of 40 to 400ms and holds of 1.1 to 2s. There are also traces of
+ * noise alone: spikes and bursts of under 8ms. More traces can be given as
+ * files, one edge per line:
+ *
+ *	# expect short			(or long, or none)
+ *	<time in us> <level, 0 is pushed>
+ *
+ * Reports the latency from letting go to the short push, and from pushing to
+ * the long push, and the pushes missed or made up. Fails if a push is missed,
+ * one is made up, or a short push takes longer than 30ms after letting go.
+ ********************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "button.h"
+
+#define STEP_US			100		// Time step of the simulation
+#define SLICE_MS		10		// As in snowflake.c
+#define MAX_EDGES		64
+#define MAX_LATENCY_MS	30		// For a short push, after letting go
+#define NUM_TRACES		1000	// Of each kind
+
+enum {
+	EXPECT_NONE,
+	EXPECT_SHORT,
+	EXPECT_LONG,
+};
+
+struct trace {
+	uint32_t time[MAX_EDGES];	// us, at which the level changes
+	uint8_t level[MAX_EDGES];	// 0 while pushed
+	uint8_t num_edges;
+	uint32_t end;				// us
+	uint8_t expect;
+	uint32_t push;				// us, first edge of the push
+	uint32_t release;			// us, first edge of letting go
+};
+
+struct result {
+	uint8_t event;
+	uint32_t at;				// us
+	uint8_t count;				// Number of events
+};
+
+static uint32_t seed = 12345;
+
+static uint32_t random_range(uint32_t low, uint32_t high)
+{
+
+	seed = seed * 1103515245 + 12345;
+
+	return low + (seed >> 8) % (high - low + 1);
+
+}
+
+static void add_edge(struct trace *trace, uint32_t time, uint8_t level)
+{
+
+	if (trace->num_edges < MAX_EDGES) {
+		trace->time[trace->num_edges] = time;
+		trace->level[trace->num_edges] = level;
+		trace->num_edges++;
+	}
+
+}
+
+/* Edges of a contact settling at level, from time on. Returns the time it is settled */
+static uint32_t add_bounce(struct trace *trace, uint32_t time, uint8_t level)
+{
+
+	uint8_t bounces = random_range(0, 3);
+
+	while (bounces--) {
+		add_edge(trace, time, level);
+		time += random_range(100, 1500);
+		add_edge(trace, time, !level);
+		time += random_range(100, 1500);
+	}
+
+	add_edge(trace, time, level);
+
+	return time;
+
+}
+
+static void make_push(struct trace *trace, uint32_t hold_low, uint32_t hold_high, uint8_t expect)
+{
+
+	uint32_t time = random_range(20000, 60000);
+
+	memset(trace, 0, sizeof(*trace));
+	trace->expect = expect;
+	trace->push = time;
+	time = add_bounce(trace, time, 0);
+	trace->release = trace->push + random_range(hold_low, hold_high);
+	if (trace->release < time + 1000) {
+		trace->release = time + 1000;
+	}
+	time = add_bounce(trace, trace->release, 1);
+	trace->end = time + 300000;
+
+}
+
+static void make_noise(struct trace *trace)
+{
+
+	uint32_t time = random_range(20000, 60000);
+	uint32_t end = time + random_range(100, 8000);
+
+	memset(trace, 0, sizeof(*trace));
+	trace->expect = EXPECT_NONE;
+
+	// Spikes low, all of them within 8ms
+	while (time < end) {
+		add_edge(trace, time, 0);
+		time += random_range(100, 2000);
+		if (time > end) {
+			time = end;
+		}
+		add_edge(trace, time, 1);
+		time += random_range(100, 3000);
+	}
+
+	trace->end = time + 300000;
+
+}
+
+static uint8_t level_at(const struct trace *trace, uint32_t time)
+{
+
+	uint8_t level = 1;
+	uint8_t edge;
+
+	for (edge = 0; edge < trace->num_edges && trace->time[edge] <= time; edge++) {
+		level = trace->level[edge];
+	}
+
+	return level;
+
+}
+
+/* The firmware around the detector: PCINT0_vect, TIM0_COMPA_vect and the main loop */
+static struct result replay(const struct trace *trace, uint32_t slice_phase_us)
+{
+
+	struct button button = { 0, 0 };
+	struct result result = { BUTTON_EVENT_NONE, 0, 0 };
+	uint8_t pcie = 1;
+	uint8_t pcif = 0;
+	uint8_t acknowledged = 1;
+	uint8_t level = 1;
+	uint32_t ack_at = 0;
+	uint32_t time;
+
+	for (time = 0; time < trace->end; time += STEP_US) {
+
+		uint8_t now = level_at(trace, time);
+
+		if (now != level) {
+			pcif = 1;
+			level = now;
+		}
+
+		// Pin change interrupt
+		if (pcie && pcif) {
+			pcif = 0;
+			if (level == 0 && acknowledged && button.down_count == 0) {
+				pcie = 0;
+				button_press(&button);
+			}
+		}
+
+		// The main loop takes the event a ms later
+		if (!acknowledged && time >= ack_at) {
+			acknowledged = 1;
+		}
+
+		// Timer slice
+		if (time % (SLICE_MS * 1000) == slice_phase_us) {
+
+			if (acknowledged && button.down_count) {
+
+				uint8_t event = button_slice(&button, level == 0);
+
+				if (event != BUTTON_EVENT_NONE) {
+					if (result.count++ == 0) {
+						result.event = event;
+						result.at = time;
+					}
+					acknowledged = 0;
+					ack_at = time + 1000;
+				}
+
+			}
+
+			if (button.down_count == 0 && !pcie) {
+				pcif = 0;
+				pcie = 1;
+			}
+
+		}
+
+	}
+
+	return result;
+
+}
+
+static int compare(const void *a, const void *b)
+{
+
+	return (int) *(const uint32_t *) a - (int) *(const uint32_t *) b;
+
+}
+
+static uint32_t latency_short[2 * NUM_TRACES];
+static uint32_t latency_long[2 * NUM_TRACES];
+static uint32_t num_short, num_long, missed, wrong, made_up, noise_traces;
+
+static void check(const struct trace *trace, const char *name)
+{
+
+	struct result result = replay(trace, random_range(0, SLICE_MS * 1000 / STEP_US - 1) * STEP_US);
+
+	if (trace->expect == EXPECT_NONE) {
+		noise_traces++;
+		if (result.count) {
+			made_up++;
+			if (name) {
+				printf("%s: push made up\n", name);
+			}
+		}
+		return;
+	}
+
+	if (result.count == 0) {
+		missed++;
+	} else if (result.count > 1 || result.event != (trace->expect == EXPECT_SHORT ? BUTTON_EVENT_SHORT : BUTTON_EVENT_LONG)) {
+		wrong++;
+	} else if (trace->expect == EXPECT_SHORT) {
+		latency_short[num_short++] = (result.at - trace->release) / 1000;
+	} else {
+		latency_long[num_long++] = (result.at - trace->push) / 1000;
+	}
+
+	if (name && (result.count != 1 || result.event != (trace->expect == EXPECT_SHORT ? BUTTON_EVENT_SHORT : BUTTON_EVENT_LONG))) {
+		printf("%s: wrong or missed push\n", name);
+	}
+
+}
+
+static int read_trace(const char *path, struct trace *trace)
+{
+
+	FILE *file = fopen(path, "r");
+	char line[128];
+	unsigned long time;
+	unsigned level;
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	memset(trace, 0, sizeof(*trace));
+	trace->expect = EXPECT_SHORT;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strstr(line, "expect long")) {
+			trace->expect = EXPECT_LONG;
+		} else if (strstr(line, "expect none")) {
+			trace->expect = EXPECT_NONE;
+		} else if (line[0] != '#' && sscanf(line, "%lu %u", &time, &level) == 2) {
+			if (level == 0 && trace->push == 0) {
+				trace->push = time;
+			}
+			if (level && trace->push && (trace->num_edges == 0 || trace->level[trace->num_edges - 1] == 0)) {
+				if (trace->release <= trace->push || time - trace->release > 20000) {
+					trace->release = time;
+				}
+			}
+			add_edge(trace, time, level != 0);
+		}
+	}
+
+	fclose(file);
+	trace->end = (trace->num_edges ? trace->time[trace->num_edges - 1] : 0) + 300000;
+
+	return 1;
+
+}
+
+static void report(const char *what, uint32_t *latency, uint32_t num)
+{
+
+	if (num == 0) {
+		return;
+	}
+
+	qsort(latency, num, sizeof(*latency), compare);
+	printf("%-30s min %4u  p50 %4u  p90 %4u  p99 %4u  max %4u ms  (%u pushes)\n", what,
+		latency[0], latency[num / 2], latency[num * 9 / 10], latency[num * 99 / 100], latency[num - 1], num);
+
+}
+
+int main(int argc, char **argv)
+{
+
+	struct trace trace;
+	uint32_t i;
+	int arg;
+
+	for (i = 0; i < NUM_TRACES; i++) {
+		make_push(&trace, 40000, 400000, EXPECT_SHORT);
+		check(&trace, NULL);
+		make_push(&trace, 1100000, 2000000, EXPECT_LONG);
+		check(&trace, NULL);
+		make_noise(&trace);
+		check(&trace, NULL);
+	}
+
+	for (arg = 1; arg < argc; arg++) {
+		if (read_trace(argv[arg], &trace)) {
+			check(&trace, argv[arg]);
+		}
+	}
+
+	report("short push, after letting go", latency_short, num_short);
+	report("long push, after pushing", latency_long, num_long);
+	printf("missed %u, wrong %u, made up %u in %u noise traces (%.2f%%)\n",
+		missed, wrong, made_up, noise_traces, noise_traces ? 100.0 * made_up / noise_traces : 0.0);
+
+	if (missed || wrong || made_up || (num_short && latency_short[num_short - 1] > MAX_LATENCY_MS)) {
+		printf("FAIL\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+
+}
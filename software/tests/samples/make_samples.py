@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""
+make_samples.py
+
+Writes the sound files audio_test is run on in "make test". They are made
+here rather than recorded, so that they are the same everywhere: a kick drum
+(a falling tone around the bass band, four hits) and a whistle (a tone in the
+high band with vibrato and breath noise), both 8 bit, 8kHz, two seconds, with
+some room noise under them. Recordings can be given to audio_test the same
+way.
+
+Usage:
+	make_samples.py			(in tests/samples)
+"""
+
+import math
+import random
+import wave
+
+RATE = 8000
+SECONDS = 2
+
+
+def write(path, samples):
+	with wave.open(path, 'wb') as f:
+		f.setnchannels(1)
+		f.setsampwidth(1)
+		f.setframerate(RATE)
+		f.writeframes(bytes(max(0, min(255, round(128 + 127 * s))) for s in samples))
+
+
+def kick(random):
+	out = []
+	phase = 0.0
+	for i in range(RATE * SECONDS):
+		t = (i % (RATE // 2)) / RATE		# Two hits a second
+		hz = 80 + 60 * math.exp(-t / 0.03)
+		phase += 2 * math.pi * hz / RATE
+		out.append(0.8 * math.exp(-t / 0.15) * math.sin(phase) + random.gauss(0, 0.02))
+	return out
+
+
+def whistle(random):
+	out = []
+	phase = 0.0
+	for i in range(RATE * SECONDS):
+		t = i / RATE
+		hz = 800 + 20 * math.sin(2 * math.pi * 5 * t)
+		phase += 2 * math.pi * hz / RATE
+		level = 0.6 * min(1, t / 0.1, (SECONDS - t) / 0.1)
+		out.append(level * math.sin(phase) + random.gauss(0, 0.05))
+	return out
+
+
+def main():
+	write('kick.wav', kick(random.Random(1)))
+	write('whistle.wav', whistle(random.Random(2)))
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,384 @@
+/********************************************************************************
+ * stream_test.c
+ *
+ * Runs the packet receiver of stream.c on the host. First a few packets are
+ * fed straight to stream_byte, to check that
+ *
+ *	- a good keyframe is ready to show, and a bad one is held back,
+ *	- after a bad packet, deltas are held back until the next good keyframe,
+ *	- a delta that comes while the last frame has not gone out is dropped,
+ *	  and the deltas after it are held back too.
+ *
+ * Then recordings made by tools/stream_frames.py --record are played into it
+ * over a simulated line at STREAM_BAUD, as the firmware at 20MHz would see
+ * them: every falling edge raises INT0, the interrupt samples the bits as
+ * stream_receive does, from whenever it gets to run, and clears INT0 at the
+ * stop bit. A good packet is sent to the LEDs after RENDER_US, with
+ * interrupts off for SEND_US, so edges in that time wait for it, and a byte
+ * that starts then is read late, wrong, or not at all, as on the target.
+ *
+ * Each recording is played as it is and with a bit flipped in one byte out
+ * of ERROR_BYTES. Reports the packets read good and bad and the frames shown
+ * per second. Fails if a frame is shown that the host did not send, or if
+ * the clean recording loses a packet.
+ ********************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+
+#define STREAM_ENABLE	1
+#define STREAM_PROFILE
+#include "../stream.c"
+
+#define NUM_LEDS		18
+#define FRAME_BYTES		(NUM_LEDS * WS2812_BYTES_PER_LED)
+#define ENTRY_US		1.6			// Interrupt response and prologue, 32 cycles
+#define RENDER_US		300.0		// From a good packet to sending it
+#define SEND_US			540.0		// Interrupts off for 18 LEDs
+#define ERROR_BYTES		500
+#define MAX_BYTES		200000
+
+uint8_t DDRB, PINB, MCUCR, GIFR, GIMSK, PORTB;
+
+struct line_byte {
+	double start;				// us, falling edge of the start bit
+	uint8_t value;
+	uint16_t packet;			// Index of the packet it is in
+};
+
+static struct line_byte line[MAX_BYTES];
+static uint32_t num_bytes;
+static uint16_t num_packets;
+static uint8_t (*reference)[FRAME_BYTES];	// Frame on the host after each packet
+static double bit_us;
+static int failures;
+
+static void expect(int ok, const char *what)
+{
+
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+
+}
+
+/* Feeds a packet with its checksum, or a wrong one */
+static void feed(const uint8_t *body, uint8_t length, uint8_t good, uint16_t *now)
+{
+
+	uint8_t sum = 0;
+	uint8_t i;
+
+	*now += STREAM_GAP_MS;
+	for (i = 0; i < length; i++) {
+		stream_byte(body[i], *now);
+		sum += body[i];
+	}
+	stream_byte(good ? sum : sum + 1, *now);
+
+}
+
+static void check_packets(void)
+{
+
+	struct RGB frame[NUM_LEDS];
+	uint8_t keyframe[1 + FRAME_BYTES];
+	uint8_t delta[] = { STREAM_DELTA, 1, 5, 0x11, 0x22, 0x33 };
+	uint16_t now = 0;
+	uint8_t i;
+
+	memset(frame, 0, sizeof(frame));
+	stream_start(frame, NUM_LEDS);
+
+	keyframe[0] = STREAM_KEYFRAME;
+	for (i = 0; i < FRAME_BYTES; i++) {
+		keyframe[1 + i] = i + 1;
+	}
+
+	feed(keyframe, sizeof(keyframe), 1, &now);
+	expect(stream_ready && !stream_hold && !memcmp(frame, keyframe + 1, FRAME_BYTES), "good keyframe shown");
+	stream_ready = 0;
+
+	feed(keyframe, sizeof(keyframe), 0, &now);
+	expect(!stream_ready && stream_hold, "bad keyframe held back");
+	feed(delta, sizeof(delta), 1, &now);
+	expect(!stream_ready && stream_hold, "delta after a bad packet held back");
+	feed(keyframe, sizeof(keyframe), 1, &now);
+	expect(stream_ready && !stream_hold, "good keyframe after a bad one shown");
+
+	// Not sent yet: the delta is dropped, and the next one is no good without it
+	feed(delta, sizeof(delta), 1, &now);
+	expect(stream_ready && !stream_hold && !memcmp(frame, keyframe + 1, FRAME_BYTES), "delta dropped while a frame waits");
+	stream_ready = 0;
+	delta[3] = 0x44;
+	feed(delta, sizeof(delta), 1, &now);
+	expect(!stream_ready && stream_hold, "delta after a dropped one held back");
+	feed(keyframe, sizeof(keyframe), 1, &now);
+	stream_ready = 0;
+	feed(delta, sizeof(delta), 1, &now);
+	expect(stream_ready && !stream_hold && frame[5].green == 0x44, "delta on a good keyframe shown");
+
+	stream_stop();
+
+}
+
+/* A recording: <uint32 ms> <uint8 length> <packet>, little endian */
+static int read_recording(const char *path)
+{
+
+	FILE *file = fopen(path, "rb");
+	uint8_t header[5], data[256];
+	uint8_t frame[FRAME_BYTES];
+	uint32_t at;
+	uint16_t i, led, count;
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	num_bytes = 0;
+	num_packets = 0;
+	memset(frame, 0, sizeof(frame));
+	free(reference);
+	reference = NULL;
+
+	while (fread(header, 1, 5, file) == 5) {
+
+		at = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t) header[3] << 24;
+		if (fread(data, 1, header[4], file) != header[4] || num_bytes + header[4] > MAX_BYTES) {
+			break;
+		}
+
+		for (i = 0; i < header[4]; i++) {
+			line[num_bytes].start = at * 1000.0 + i * 10 * bit_us;
+			line[num_bytes].value = data[i];
+			line[num_bytes].packet = num_packets;
+			num_bytes++;
+		}
+
+		// The frame the host means
+		if (data[0] == STREAM_KEYFRAME) {
+			memcpy(frame, data + 1, FRAME_BYTES);
+		} else {
+			for (count = 0; count < data[1]; count++) {
+				led = data[2 + count * (1 + WS2812_BYTES_PER_LED)];
+				memcpy(frame + led * WS2812_BYTES_PER_LED, data + 3 + count * (1 + WS2812_BYTES_PER_LED), WS2812_BYTES_PER_LED);
+			}
+		}
+		reference = realloc(reference, (num_packets + 1) * sizeof(*reference));
+		memcpy(reference[num_packets], frame, FRAME_BYTES);
+		num_packets++;
+
+	}
+
+	fclose(file);
+
+	if (num_packets == 0) {
+		printf("%s: no packets\n", path);
+	}
+
+	return num_packets != 0;
+
+}
+
+/* Line level at a time: high between bytes, else the bit of the byte */
+static uint8_t level_at(double t)
+{
+
+	uint32_t low = 0, high = num_bytes;
+	uint32_t middle;
+	int bit;
+
+	// Last byte that started at or before t
+	while (high - low > 1) {
+		middle = (low + high) / 2;
+		if (line[middle].start <= t) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+
+	if (num_bytes == 0 || t < line[low].start) {
+		return 1;
+	}
+
+	bit = (int) ((t - line[low].start) / bit_us);
+	if (bit == 0) {
+		return 0;
+	}
+	if (bit <= 8) {
+		return (line[low].value >> (bit - 1)) & 1;
+	}
+
+	return 1;
+
+}
+
+/* Next falling edge at or after t, or a negative time if there is none */
+static double next_edge(double t, uint32_t *from)
+{
+
+	uint32_t i;
+	int bit;
+	double edge;
+
+	for (i = *from; i < num_bytes; i++) {
+
+		if (line[i].start >= t) {
+			*from = i;
+			return line[i].start;
+		}
+
+		// Edges inside the byte: a 0 after a 1
+		for (bit = 1; bit < 8; bit++) {
+			edge = line[i].start + (bit + 1) * bit_us;
+			if (edge >= t && !(line[i].value >> bit & 1) && (line[i].value >> (bit - 1) & 1)) {
+				*from = i;
+				return edge;
+			}
+		}
+
+	}
+
+	return -1;
+
+}
+
+/* Plays the line into the receiver. Returns the frames shown */
+static uint32_t play(uint32_t *wrong)
+{
+
+	struct RGB frame[NUM_LEDS];
+	uint8_t sent[FRAME_BYTES];
+	double busy_until = 0;		// Interrupts off or in the INT0 interrupt till then
+	double send_at = -1;		// A good packet goes out then
+	double t = 0, entry, edge;
+	uint32_t from = 0, shown = 0;
+	uint16_t packet, newest = 0;
+	uint8_t byte, bit;
+
+	memset(frame, 0, sizeof(frame));
+	stream_start(frame, NUM_LEDS);
+	stream_frames = 0;
+	stream_errors = 0;
+	*wrong = 0;
+
+	for (;;) {
+
+		edge = next_edge(t, &from);
+
+		// Frame out first, if it is due before the interrupt could run
+		if (send_at >= 0 && (edge < 0 || send_at <= (edge > busy_until ? edge : busy_until))) {
+			if (send_at < busy_until) {
+				send_at = busy_until;
+			}
+			memcpy(sent, frame, FRAME_BYTES);
+			stream_ready = 0;
+			busy_until = send_at + SEND_US;
+			shown++;
+
+			// Must be a frame the host sent, by the packets read so far
+			for (packet = 0; packet <= newest && memcmp(sent, reference[packet], FRAME_BYTES); packet++);
+			if (packet > newest) {
+				(*wrong)++;
+			}
+
+			send_at = -1;
+			continue;
+		}
+
+		if (edge < 0) {
+			break;
+		}
+
+		// INT0: runs once the CPU is free, and samples from then on
+		entry = (edge > busy_until ? edge : busy_until) + ENTRY_US;
+		byte = 0;
+		for (bit = 0; bit < 8; bit++) {
+			byte = (byte >> 1) | (level_at(entry - ENTRY_US + (1.5 + bit) * bit_us) << 7);
+		}
+		busy_until = entry - ENTRY_US + 9.5 * bit_us;
+		if (line[from].packet > newest) {
+			newest = line[from].packet;
+		}
+
+		stream_byte(byte, (uint16_t) (entry / 1000));
+
+		if (stream_ready && send_at < 0) {
+			send_at = busy_until + RENDER_US;
+		}
+
+		// Edges before the stop bit were cleared with INT0
+		t = busy_until;
+
+	}
+
+	stream_stop();
+
+	return shown;
+
+}
+
+static void check_recording(const char *path)
+{
+
+	uint32_t shown, wrong, i;
+	double seconds;
+	uint8_t noisy;
+
+	if (!read_recording(path)) {
+		failures++;
+		return;
+	}
+
+	seconds = (line[num_bytes - 1].start + 10 * bit_us) / 1000000.0;
+	printf("%s: %u packets, %.2fs at %u baud\n", path, num_packets, seconds, (unsigned) STREAM_BAUD);
+
+	for (noisy = 0; noisy < 2; noisy++) {
+
+		if (noisy) {
+			srand(1);
+			for (i = 0; i < num_bytes; i++) {
+				if (rand() % ERROR_BYTES == 0) {
+					line[i].value ^= 1 << (rand() % 8);
+				}
+			}
+		}
+
+		shown = play(&wrong);
+		printf("  %-6s read %4u good, %3u bad, %4u frames shown, %5.1f per second, %u wrong\n",
+			noisy ? "noisy" : "clean", stream_frames, stream_errors, shown, shown / seconds, wrong);
+
+		expect(wrong == 0, "frame shown that the host did not send");
+		if (!noisy) {
+			expect(stream_frames == num_packets && stream_errors == 0, "packet lost on a clean line");
+		}
+
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+
+	int arg;
+
+	bit_us = 1000000.0 / STREAM_BAUD;
+
+	check_packets();
+
+	for (arg = 1; arg < argc; arg++) {
+		check_recording(argv[arg]);
+	}
+
+	printf(failures ? "FAIL\n" : "PASS\n");
+
+	return failures != 0;
+
+}
@@ -0,0 +1,396 @@
+/********************************************************************************
+ * sync_test.c
+ *
+ * Two snowflakes on one sync line, simulated on the host in 10us steps: a
+ * master and a slave, each with its own ms clock (the slave's off by up to
+ * 100ppm, a crystal), the pulse code in sync.h, and the parts of snowflake.c
+ * around it: the timer interrupt that ends the master's pulses, the INT0
+ * interrupt that times them on the slave, the input task that announces a
+ * pattern change and keeps the next one pending while a pulse is sent, and
+ * the render task that sends or waits for the frame pulses. Both take 0.2 to
+ * 3ms to draw a frame and then keep interrupts off for 0.6ms to send it.
+ *
+ * Every other pattern change is asked for 1 to 100ms after the last, mostly
+ * while its pulse is still being sent, and the others 0.3 to 3s after it, so
+ * that the frame pulses run for a while. One that is asked for while the
+ * last is still pending is the same change, as next_pattern is a flag.
+ *
+ * Reports how far apart the two change pattern and start their frames. Fails
+ * if the slave reads a pulse wrong or misses one, if a change is lost, or if
+ * they are further apart than one of them can be held up by drawing (3ms)
+ * and sending (0.6ms) a frame. On a frame that only happens when the slave
+ * is drawing one of its own, after a pattern pulse long enough for it to
+ * stop waiting for the master's frames.
+ ********************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sync.h"
+
+#define STEP_NS				10000
+#define SECONDS				60			// Per run
+#define NUM_PATTERNS		50			// The most sync.h allows
+#define FRAME_MS			20
+#define SEND_NS				600000		// Interrupts off for a frame
+#define SYNC_FRAME_SLACK_MS	4			// As in snowflake.c
+#define LOCK_MS				2000		// Slave follows the master this long after a pulse
+#define MAX_CHANGE_US		3600
+#define MAX_FRAME_US		3600
+#define MAX_EVENTS			8192
+
+struct mcu {
+	uint64_t next_tick;				// ns
+	uint32_t period;				// ns per ms tick
+	uint8_t tick_pending;
+	uint64_t cli_until;				// ns, interrupts off until
+	uint64_t busy_until;			// ns, drawing a frame until
+	uint8_t send_pending;
+	uint16_t ms;
+	uint16_t wake;
+	uint8_t pattern;
+	uint8_t next_pattern;
+	uint8_t sync_pattern;
+};
+
+/* Master */
+static struct mcu master;
+static uint8_t line_low;
+static uint8_t pulse_ms;
+static uint8_t pulse_ended;
+static uint16_t request_at;
+
+/* Slave */
+static struct mcu slave;
+static uint8_t int0_pending;
+static uint8_t line_seen;
+static uint16_t pulse_start;
+static uint8_t pulse_low;
+static uint8_t sync_frame;
+static uint8_t frame_pulse;			// The pulse that set sync_frame is a frame pulse
+static uint16_t locked_until;
+static uint8_t locked;
+
+/* Pulses sent and not read yet */
+static uint8_t sent[MAX_EVENTS];
+static uint32_t sent_head, sent_tail;
+
+/* Times of the pattern changes and frame pulses, ns */
+static uint64_t master_change[MAX_EVENTS], slave_change[MAX_EVENTS];
+static uint32_t master_changes, slave_changes;
+static uint64_t master_frame[MAX_EVENTS], slave_frame[MAX_EVENTS];
+static uint32_t master_frames, slave_frames;
+
+static uint32_t requests, merged, misread, fallback_frames;
+static uint32_t change_us[MAX_EVENTS * 8], frame_us[MAX_EVENTS * 8];
+static uint32_t num_change_us, num_frame_us;
+static uint32_t seed = 4321;
+
+static uint32_t random_range(uint32_t low, uint32_t high)
+{
+
+	seed = seed * 1103515245 + 12345;
+
+	return low + (seed >> 8) % (high - low + 1);
+
+}
+
+static void mcu_reset(struct mcu *mcu, uint32_t period)
+{
+
+	mcu->period = period;
+	mcu->next_tick = random_range(0, 999) * 1000ULL;
+	mcu->tick_pending = 0;
+	mcu->cli_until = 0;
+	mcu->busy_until = 0;
+	mcu->send_pending = 0;
+	mcu->ms = 0;
+	mcu->wake = 0;
+	mcu->pattern = 0;
+	mcu->next_pattern = 0;
+	mcu->sync_pattern = SYNC_NO_PATTERN;
+
+}
+
+static void mcu_draw(struct mcu *mcu, uint64_t now)
+{
+
+	mcu->busy_until = now + random_range(200, 3000) * 1000ULL;
+	mcu->send_pending = 1;
+
+}
+
+/* The main loop is free: not drawing, not sending */
+static uint8_t mcu_main(struct mcu *mcu, uint64_t now)
+{
+
+	if (now < mcu->busy_until || now < mcu->cli_until) {
+		return 0;
+	}
+
+	if (mcu->send_pending) {
+		mcu->send_pending = 0;
+		mcu->cli_until = now + SEND_NS;
+		return 0;
+	}
+
+	return 1;
+
+}
+
+static void sync_send(uint8_t pattern)
+{
+
+	uint8_t ms = SYNC_FRAME_PULSE_MS;
+
+	if (pattern != SYNC_FRAME) {
+		master.sync_pattern = pattern;
+		ms = SYNC_PULSE_MS(pattern);
+	}
+
+	line_low = 1;
+	pulse_ms = ms + SYNC_GAP_MS;
+	sent[sent_head++ % MAX_EVENTS] = pattern;
+
+}
+
+static void master_step(uint64_t now)
+{
+
+	if (now >= master.next_tick) {
+		master.tick_pending = 1;
+		master.next_tick += master.period;
+	}
+
+	// TIM0_COMPA_vect
+	if (master.tick_pending && now >= master.cli_until) {
+		master.tick_pending = 0;
+		master.ms++;
+		if (pulse_ms && --pulse_ms == SYNC_GAP_MS) {
+			line_low = 0;
+			if (master.sync_pattern != SYNC_NO_PATTERN) {
+				pulse_ended = 1;
+			}
+		}
+		if (master.ms == request_at) {
+			if (master.next_pattern) {
+				merged++;
+			}
+			master.next_pattern = 1;
+			requests++;
+			request_at = master.ms + (requests & 1 ? random_range(1, 100) : random_range(300, 3000));
+		}
+	}
+
+	if (!mcu_main(&master, now)) {
+		return;
+	}
+
+	// input_run
+	if (master.next_pattern && !pulse_ms && master.sync_pattern == SYNC_NO_PATTERN) {
+		master.next_pattern = 0;
+		sync_send(master.pattern + 1 == NUM_PATTERNS ? 0 : master.pattern + 1);
+	}
+	if (pulse_ended) {
+		pulse_ended = 0;
+		master.pattern = master.sync_pattern;
+		master.sync_pattern = SYNC_NO_PATTERN;
+		master_change[master_changes++ % MAX_EVENTS] = now;
+		master.wake = master.ms;
+	}
+
+	// render_run
+	if ((int16_t) (master.ms - master.wake) >= 0) {
+		if (!pulse_ms && master.sync_pattern == SYNC_NO_PATTERN) {
+			sync_send(SYNC_FRAME);
+			master_frame[master_frames++ % MAX_EVENTS] = now;
+		}
+		master.wake = master.ms + FRAME_MS;
+		mcu_draw(&master, now);
+	}
+
+}
+
+static void slave_step(uint64_t now)
+{
+
+	uint8_t pattern;
+
+	if (now >= slave.next_tick) {
+		slave.tick_pending = 1;
+		slave.next_tick += slave.period;
+	}
+
+	if (line_low != line_seen) {
+		line_seen = line_low;
+		int0_pending = 1;
+	}
+
+	// INT0_vect goes before TIM0_COMPA_vect
+	if (int0_pending && now >= slave.cli_until) {
+
+		int0_pending = 0;
+
+		if (line_low) {
+			pulse_start = slave.ms;
+			pulse_low = 1;
+			sync_frame = 1;
+			frame_pulse = sent_tail != sent_head && sent[sent_tail % MAX_EVENTS] == SYNC_FRAME;
+		} else if (pulse_low) {
+			pulse_low = 0;
+			pattern = sync_decode(slave.ms - pulse_start);
+			if (sent_tail == sent_head || sent[sent_tail++ % MAX_EVENTS] != pattern) {
+				misread++;
+			}
+			if (pattern == SYNC_FRAME) {
+				locked = 1;
+				locked_until = slave.ms + LOCK_MS;
+			} else if (pattern < NUM_PATTERNS) {
+				slave.sync_pattern = pattern;
+				slave.next_pattern = 1;
+				locked = 1;
+				locked_until = slave.ms + LOCK_MS;
+			}
+		}
+
+	} else if (slave.tick_pending && now >= slave.cli_until) {
+		slave.tick_pending = 0;
+		slave.ms++;
+		if (locked && slave.ms == locked_until) {
+			locked = 0;
+		}
+	}
+
+	if (!mcu_main(&slave, now)) {
+		return;
+	}
+
+	// input_run
+	if (slave.next_pattern) {
+		slave.next_pattern = 0;
+		slave.pattern = slave.sync_pattern;
+		slave.sync_pattern = SYNC_NO_PATTERN;
+		slave_change[slave_changes++ % MAX_EVENTS] = now;
+		slave.wake = slave.ms;
+	}
+
+	// render_run
+	if (sync_frame || (int16_t) (slave.ms - slave.wake) >= 0) {
+		if (sync_frame) {
+			if (frame_pulse) {
+				slave_frame[slave_frames++ % MAX_EVENTS] = now;
+			}
+		} else if (locked) {
+			fallback_frames++;
+		}
+		sync_frame = 0;
+		slave.wake = slave.ms + FRAME_MS + (locked ? SYNC_FRAME_SLACK_MS : 0);
+		mcu_draw(&slave, now);
+	}
+
+}
+
+/* Pair up the events of both sides that have happened so far */
+static void pair(uint64_t *a, uint32_t *num_a, uint64_t *b, uint32_t *num_b, uint32_t *out, uint32_t *num_out)
+{
+
+	uint32_t i;
+	uint32_t num = *num_a < *num_b ? *num_a : *num_b;
+
+	for (i = 0; i < num; i++) {
+		uint64_t x = a[i], y = b[i];
+		out[(*num_out)++] = (x > y ? x - y : y - x) / 1000;
+	}
+
+	// Keep what has no partner yet
+	for (i = num; i < *num_a; i++) {
+		a[i - num] = a[i];
+	}
+	for (i = num; i < *num_b; i++) {
+		b[i - num] = b[i];
+	}
+	*num_a -= num;
+	*num_b -= num;
+
+}
+
+static int run(int32_t ppm)
+{
+
+	uint64_t now;
+	uint64_t end = SECONDS * 1000000000ULL;
+	uint32_t changes = 0;
+
+	mcu_reset(&master, 1000000);
+	mcu_reset(&slave, 1000000 + ppm);
+	line_low = line_seen = 0;
+	pulse_ms = pulse_ended = 0;
+	request_at = 500;
+	int0_pending = pulse_low = sync_frame = locked = 0;
+	sent_head = sent_tail = 0;
+	requests = merged = 0;
+
+	for (now = 0; now < end; now += STEP_NS) {
+
+		master_step(now);
+		slave_step(now);
+
+		if (master_changes + slave_changes >= MAX_EVENTS / 2 || master_frames + slave_frames >= MAX_EVENTS / 2) {
+			changes += master_changes < slave_changes ? master_changes : slave_changes;
+			pair(master_change, &master_changes, slave_change, &slave_changes, change_us, &num_change_us);
+			pair(master_frame, &master_frames, slave_frame, &slave_frames, frame_us, &num_frame_us);
+		}
+
+	}
+
+	changes += master_changes < slave_changes ? master_changes : slave_changes;
+	pair(master_change, &master_changes, slave_change, &slave_changes, change_us, &num_change_us);
+	pair(master_frame, &master_frames, slave_frame, &slave_frames, frame_us, &num_frame_us);
+
+	printf("slave %+4dppm: %u changes asked for, %u while one was pending, %u made on both\n", (int) ppm, requests, merged, changes);
+
+	// The last one may still be on its way
+	return requests - merged - changes <= 1 && master_changes + slave_changes <= 1;
+
+}
+
+static int compare(const void *a, const void *b)
+{
+
+	return (int) *(const uint32_t *) a - (int) *(const uint32_t *) b;
+
+}
+
+static void report(const char *what, uint32_t *us, uint32_t num)
+{
+
+	qsort(us, num, sizeof(*us), compare);
+	printf("%-24s min %5u  p50 %5u  p99 %5u  max %5u us  (%u)\n", what,
+		us[0], us[num / 2], us[num * 99 / 100], us[num - 1], num);
+
+}
+
+int main(void)
+{
+
+	static const int32_t ppms[] = { -100, -30, 0, 30, 100 };
+	uint8_t i;
+	int ok = 1;
+
+	for (i = 0; i < sizeof(ppms) / sizeof(ppms[0]); i++) {
+		ok &= run(ppms[i]);
+	}
+
+	report("pattern change apart", change_us, num_change_us);
+	report("frame start apart", frame_us, num_frame_us);
+	printf("%u pulses read wrong or missed, %u slave frames without a pulse while locked\n", misread, fallback_frames);
+
+	if (!ok || misread || change_us[num_change_us - 1] > MAX_CHANGE_US || frame_us[num_frame_us - 1] > MAX_FRAME_US) {
+		printf("FAIL\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+
+}
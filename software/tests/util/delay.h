@@ -0,0 +1,9 @@
+/* util/delay.h for the host tests: nothing runs in real time here */
+
+#ifndef TESTS_UTIL_DELAY_H
+#define TESTS_UTIL_DELAY_H
+
+#define _delay_us(us)	((void) (us))
+#define _delay_ms(ms)	((void) (ms))
+
+#endif
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""
+encode_animation.py
+
+Encode a hand-drawn animation for the snowflake into a PROGMEM table for
+the animation pattern in snowflake.c.
+
+Input is a CSV file with one frame per line:
+
+	hold_ms, colour of LED 0, colour of LED 1, ..., colour of LED 17
+
+Colours are hex RRGGBB. Empty lines and lines starting with # are skipped.
+The LEDs are numbered in wiring order: LEDs 0, 1 and 2 are the outer, middle
+and inner LED of the first arm, and on every other arm the first LED is the
+middle one, then the outer one, then the inner one.
+
+Usage:
+	encode_animation.py animation.csv name > animation_data.h
+
+The stream format is described at the animation pattern in snowflake.c.
+"""
+
+import csv
+import sys
+
+NUM_LEDS = 18
+TICK_MS = 16
+
+OP_SKIP = 0x00
+OP_RUN = 0x40
+OP_LITERAL = 0x80
+MAX_COUNT = 63
+
+
+def read_frames(path):
+	frames = []
+	with open(path, newline='') as f:
+		for number, row in enumerate(csv.reader(f), 1):
+			row = [field.strip() for field in row]
+			if not row or not row[0] or row[0].startswith('#'):
+				continue
+			if len(row) != NUM_LEDS + 1:
+				sys.exit('%s:%d: %d fields, expected %d' % (path, number, len(row), NUM_LEDS + 1))
+			hold = max(1, min(255, round(int(row[0]) / TICK_MS)))
+			colours = [tuple(bytes.fromhex(field)) for field in row[1:]]
+			frames.append((hold, colours))
+	if not frames:
+		sys.exit('%s: no frames' % path)
+	return frames
+
+
+def encode_frame(colours, previous):
+	"""Ops for one frame. Without a previous frame nothing may be skipped."""
+	out = []
+	led = 0
+	while led < NUM_LEDS:
+		if previous and colours[led] == previous[led]:
+			end = led
+			while end < NUM_LEDS and colours[end] == previous[end] and end - led < MAX_COUNT:
+				end += 1
+			if end < NUM_LEDS:		# Trailing skips are left out
+				out.append(OP_SKIP | (end - led))
+			led = end
+			continue
+		end = led
+		while end < NUM_LEDS and colours[end] == colours[led] and end - led < MAX_COUNT + 1:
+			end += 1
+		if end - led >= 2:
+			out.append(OP_RUN | (end - led - 1))
+			out.extend(colours[led])
+			led = end
+			continue
+		# Literal up to the next unchanged LED or run
+		end = led + 1
+		while (end < NUM_LEDS and end - led < MAX_COUNT + 1
+				and not (previous and colours[end] == previous[end])
+				and not (end + 1 < NUM_LEDS and colours[end] == colours[end + 1])):
+			end += 1
+		out.append(OP_LITERAL | (end - led - 1))
+		for colour in colours[led:end]:
+			out.extend(colour)
+		led = end
+	out.append(0)			# End of frame
+	return out
+
+
+def encode(frames):
+	out = []
+	previous = None
+	for hold, colours in frames:
+		out.append(hold)
+		out.extend(encode_frame(colours, previous))
+		previous = colours
+	out.append(0)			# End of animation
+	return out
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit('usage: %s animation.csv name' % sys.argv[0])
+	path, name = sys.argv[1:]
+	frames = read_frames(path)
+	data = encode(frames)
+	raw = len(frames) * (NUM_LEDS * 3 + 1)
+
+	print('/* Generated by tools/encode_animation.py from %s, do not edit */' % path)
+	print('/* %d frames, %d bytes (%d uncompressed, %.1f:1) */' % (len(frames), len(data), raw, raw / len(data)))
+	print()
+	print('static const uint8_t %s[] PROGMEM = {' % name)
+	for start in range(0, len(data), 12):
+		print('\t' + ' '.join('0x%02x,' % byte for byte in data[start:start + 12]))
+	print('};')
+
+	sys.stderr.write('%d frames, %d bytes, %d uncompressed, %.1f:1\n' % (len(frames), len(data), raw, raw / len(data)))
+
+
+if __name__ == '__main__':
+	main()
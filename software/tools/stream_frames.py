@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+"""
+stream_frames.py
+
+Send frames to a snowflake running the stream pattern (build with
+-DSTREAM_ENABLE=1), over a serial line to PB2.
+
+Frames come from a CSV file in the format of tools/encode_animation.py:
+
+	hold_ms, colour of LED 0, colour of LED 1, ..., colour of LED 17
+
+and are sent as keyframes (all LEDs) or deltas (only the LEDs that changed),
+whichever is shorter, with a keyframe at least every --keyframe frames so
+that a packet lost on the line is not seen for long. The packet format is
+described in stream.h.
+
+Usage:
+	stream_frames.py animation.csv --port /dev/ttyUSB0
+	stream_frames.py animation.csv --record stream.bin
+	stream_frames.py --replay stream.bin --port /dev/ttyUSB0
+	stream_frames.py --replay stream.bin
+
+--record writes the packets with their send times instead of sending them.
+--replay sends a recording, or without --port runs it through a protocol
+model: the packet parser of stream.c, fed as a virtual UART at --baud. It
+reports the packets the parser takes and the frame rate the line allows.
+It is not an end-to-end test: it leaves out that packets are dropped while
+the last frame has not gone out yet (stream_ready), and that bytes are lost
+if they come while send_frame has interrupts off. tests/stream_test plays a
+recording into stream.c itself with both, and reports the frames shown.
+--fast ignores the hold
+times and sends as fast as the line allows, to find the highest frame rate.
+
+Sending needs pyserial.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+import time
+
+NUM_LEDS = 18
+GAP_MS = 3			# Quiet time between packets, STREAM_GAP_MS is 2
+RECEIVE_GAP_MS = 2	# STREAM_GAP_MS
+
+KEYFRAME = ord('K')
+DELTA = ord('D')
+
+ORDERS = ['grb', 'rgb', 'brg', 'grbw']		# WS2812_ORDER
+
+
+def read_frames(path):
+	frames = []
+	with open(path, newline='') as f:
+		for number, row in enumerate(csv.reader(f), 1):
+			row = [field.strip() for field in row]
+			if not row or not row[0] or row[0].startswith('#'):
+				continue
+			if len(row) != NUM_LEDS + 1:
+				sys.exit('%s:%d: %d fields, expected %d' % (path, number, len(row), NUM_LEDS + 1))
+			colours = [tuple(bytes.fromhex(field)) for field in row[1:]]
+			frames.append((int(row[0]), colours))
+	if not frames:
+		sys.exit('%s: no frames' % path)
+	return frames
+
+
+def led_bytes(colour, order):
+	"""Bytes of an LED in the order of struct RGB."""
+	channels = dict(zip('rgb', colour), w=0)
+	return [channels[c] for c in order]
+
+
+def packet(body):
+	return bytes(body + [sum(body) & 0xff])
+
+
+def encode(frames, order, keyframe_every):
+	"""(hold_ms, packet) for every frame."""
+	out = []
+	previous = None
+	since_keyframe = keyframe_every
+	for hold, colours in frames:
+		keyframe = [KEYFRAME]
+		for colour in colours:
+			keyframe.extend(led_bytes(colour, order))
+		changed = []
+		if previous is not None:
+			for led in range(NUM_LEDS):
+				if colours[led] != previous[led]:
+					changed.append(led)
+		delta = [DELTA, len(changed)]
+		for led in changed:
+			delta.append(led)
+			delta.extend(led_bytes(colours[led], order))
+		if previous is None or since_keyframe >= keyframe_every or len(delta) >= len(keyframe):
+			out.append((hold, packet(keyframe)))
+			since_keyframe = 1
+		else:
+			out.append((hold, packet(delta)))
+			since_keyframe += 1
+		previous = colours
+	return out
+
+
+def line_ms(length, baud):
+	return length * 10 * 1000.0 / baud
+
+
+def schedule(packets, baud, fast):
+	"""Send time in ms of every packet."""
+	out = []
+	now = 0.0
+	for hold, data in packets:
+		out.append((int(now), data))
+		spacing = line_ms(len(data), baud) + GAP_MS
+		now += spacing if fast else max(hold, spacing)
+	return out
+
+
+def write_recording(path, timed):
+	with open(path, 'wb') as f:
+		for at, data in timed:
+			f.write(struct.pack('<IB', at, len(data)) + data)
+
+
+def read_recording(path):
+	timed = []
+	with open(path, 'rb') as f:
+		raw = f.read()
+	offset = 0
+	while offset < len(raw):
+		at, length = struct.unpack_from('<IB', raw, offset)
+		offset += 5
+		timed.append((at, raw[offset:offset + length]))
+		offset += length
+	return timed
+
+
+def receive(timed, baud, bytes_per_led):
+	"""The packet parser in stream.c, fed byte by byte at the baud rate.
+	Returns the frame buffer after each packet the LEDs would show, and the
+	number of bad packets."""
+	buffer = bytearray(NUM_LEDS * bytes_per_led)
+	shown = []
+	errors = 0
+	last = None
+	synced = False
+	state = 'skip'
+	for at, data in timed:
+		for number, byte in enumerate(data):
+			now = int(at + line_ms(number + 1, baud))
+			if last is None or now - last >= RECEIVE_GAP_MS:
+				state = 'header'
+			last = now
+			if state == 'header':
+				total = 0
+				count = 1
+				if byte == KEYFRAME or byte == DELTA:
+					# Straight into the frame buffer, a delta only on a good frame
+					base = byte == KEYFRAME or synced
+					synced = False
+				if byte == KEYFRAME:
+					write = 0
+					left = len(buffer)
+					state = 'data'
+				elif byte == DELTA:
+					state = 'count'
+				else:
+					state = 'skip'
+			elif state == 'count':
+				count = byte
+				state = 'index' if count else 'checksum'
+			elif state == 'index':
+				if byte < NUM_LEDS:
+					write = byte * bytes_per_led
+					left = bytes_per_led
+					state = 'data'
+				else:
+					state = 'skip'
+			elif state == 'data':
+				buffer[write] = byte
+				write += 1
+				left -= 1
+				if left == 0:
+					count -= 1
+					state = 'index' if count else 'checksum'
+			elif state == 'checksum':
+				if byte == total & 0xff:
+					synced = base
+					if synced:
+						shown.append(bytes(buffer))
+				else:
+					errors += 1
+				state = 'skip'
+			total += byte
+	return shown, errors
+
+
+def send(port, baud, timed):
+	import serial
+	line = serial.Serial(port, baud)
+	start = time.monotonic()
+	for at, data in timed:
+		delay = start + at / 1000.0 - time.monotonic()
+		if delay > 0:
+			time.sleep(delay)
+		line.write(data)
+		line.flush()
+	elapsed = time.monotonic() - start
+	line.close()
+	return elapsed
+
+
+def report(timed, baud):
+	keyframes = sum(1 for at, data in timed if data[0] == KEYFRAME)
+	total = sum(len(data) for at, data in timed)
+	duration = (timed[-1][0] + line_ms(len(timed[-1][1]), baud)) / 1000.0
+	sys.stderr.write('%d frames (%d keyframes, %d deltas), %d bytes, %.1f bytes per frame\n' %
+		(len(timed), keyframes, len(timed) - keyframes, total, total / len(timed)))
+	sys.stderr.write('%.2fs at %d baud, %.1f frames per second\n' % (duration, baud, len(timed) / duration))
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Stream frames to a snowflake')
+	parser.add_argument('frames', nargs='?', help='CSV file of frames')
+	parser.add_argument('--port', help='serial port to send to')
+	parser.add_argument('--baud', type=int, default=57600, help='STREAM_BAUD of the build (57600)')
+	parser.add_argument('--order', choices=ORDERS, default='grb', help='WS2812_ORDER of the build (grb)')
+	parser.add_argument('--keyframe', type=int, default=32, help='frames between keyframes (32)')
+	parser.add_argument('--loops', type=int, default=1, help='times to go through the frames (1)')
+	parser.add_argument('--fast', action='store_true', help='ignore the hold times')
+	parser.add_argument('--record', help='write the packets to a file instead of sending them')
+	parser.add_argument('--replay', help='send packets from a file')
+	args = parser.parse_args()
+
+	bytes_per_led = 4 if args.order == 'grbw' else 3
+
+	if args.replay:
+		timed = read_recording(args.replay)
+	elif args.frames:
+		packets = encode(read_frames(args.frames) * args.loops, args.order, args.keyframe)
+		timed = schedule(packets, args.baud, args.fast)
+	else:
+		parser.error('give a CSV file of frames or --replay')
+
+	report(timed, args.baud)
+
+	if args.record:
+		write_recording(args.record, timed)
+	elif args.port:
+		elapsed = send(args.port, args.baud, timed)
+		sys.stderr.write('sent in %.2fs, %.1f frames per second\n' % (elapsed, len(timed) / elapsed))
+	else:
+		shown, errors = receive(timed, args.baud, bytes_per_led)
+		sys.stderr.write('protocol model: %d good packets, %d bad packets\n' % (len(shown), errors))
+
+
+if __name__ == '__main__':
+	main()
@@ -2,17 +2,45 @@
 #include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
 #include "ws2812.h"
+#include "colour.h"
 
+#if WS2812_TIMING == WS2812_TIMING_WS2812
 #define T0H		400		// High time for 0 value, in ns
 #define T1H		800		// High time for 1 value, in ns
 #define Ttot	1250	// Total time for 1 bit, in ns
-
-#define NS_PER_CYCLE	(1/F_CPU) * 1000000000
-#define US_PER_CYCLE	(1/F_CPU) * 1000000
-#define T0H_CYCLES T0H / NS_PER_CYCLE
-#define T1H_CYCLES T1H / NS_PER_CYCLE
-#define Ttot_CYCLES Ttot / NS_PER_CYCLE
+#elif WS2812_TIMING == WS2812_TIMING_SK6812
+#define T0H		300
+#define T1H		600
+#define Ttot	1250
+#elif WS2812_TIMING == WS2812_TIMING_WS2811
+#define T0H		500
+#define T1H		1200
+#define Ttot	2500
+#else
+#error "Unknown WS2812_TIMING"
+#endif
+
+uint8_t ws2812_dim = 0;
+
+#if WS2812_OUTPUT == WS2812_OUTPUT_BITBANG
+
+#define NS_TO_CYCLES(ns)	(((ns) * (F_CPU / 1000000UL) + 500) / 1000)
+#define T0H_CYCLES NS_TO_CYCLES(T0H)
+#define T1H_CYCLES NS_TO_CYCLES(T1H)
+#define Ttot_CYCLES NS_TO_CYCLES(Ttot)
+
+// Padding nops per phase, see the cycle counts in send_data below
+#if T0H_CYCLES < 3 || T1H_CYCLES < T0H_CYCLES + 3 || Ttot_CYCLES < T1H_CYCLES + 5
+#error "F_CPU is too low for the selected WS2812_TIMING"
+#endif
+
+#define PHASE_A_NOPS	(T0H_CYCLES - 3)
+#define PHASE_B_NOPS	(T1H_CYCLES - T0H_CYCLES - 3)
+#define PHASE_C_NOPS	(Ttot_CYCLES - T1H_CYCLES - 5)
 
 /********************************************************************************
  * send_data
@@ -45,6 +73,11 @@
  * We are running at 20MHz, so 1 processor cycle is 50ns. So A and B are 8 cycles
  * and C should be 9.
  *
+ * Those are the WS2812 numbers. The other timings only change the number of
+ * padding nops in each phase (PHASE_A/B/C_NOPS), which are worked out from the
+ * nanosecond values and F_CPU at compile time. The fixed instructions take 3
+ * cycles of A, 3 of B and 5 of C. The cycle comments below are for WS2812.
+ *
  * The implementation of this is heavily inspired by cpucpld's light_ws2812 
  * library at https://github.com/cpldcpu/light_ws2812/
  ********************************************************************************/
@@ -54,8 +87,7 @@ static void send_data(uint8_t *framebuffer, uint16_t data_length, uint8_t data_p
 
 	uint8_t current_byte;
 	uint8_t i;
-
-	cli();
+	uint8_t dim = ws2812_dim;
 
 	uint8_t high_value = PORTB | (1 << data_pin);
 	uint8_t low_value = PORTB & ~(1 << data_pin);
@@ -65,76 +97,388 @@ static void send_data(uint8_t *framebuffer, uint16_t data_length, uint8_t data_p
 
 	while ( data_length--) {				// 5
 
-		// Fetch next byte. 
+		// Fetch next byte. Dimming lengthens the low time after the
+		// last bit of the byte a little, which the LEDs don't mind
 
-		current_byte = *framebuffer++;		// 2
+		current_byte = *framebuffer++ >> dim;		// 2 + 3 per step
 
 		// Push out 8 bits.
 		  
 		asm volatile (
 			"	ldi %[loopcounter], 8 	\n\t" 	// 1 - 24
-			" loop: "
+			" loop%=: "
 			"	out %[port], %[high]	\n\t" 	// 1 - 25 
 
 		// Phase A
 		
-			"	nop			\n\t"	// 1 - 1
-			"	nop			\n\t"	// 1 - 2
-			"	nop			\n\t"	// 1 - 3
-			"	nop			\n\t"	// 1 - 4
-			"	nop			\n\t"	// 1 - 5
+			"	.rept %[a_nops]		\n\t"	// 5 - 5
+			"	nop			\n\t"
+			"	.endr			\n\t"
 			"	lsl %[data]		\n\t"	// 1 - 6
-			"	brcs bit_is_1		\n\t"	// False: 1 - 7, True 2 - 8
+			"	brcs bit_is_1%=		\n\t"	// False: 1 - 7, True 2 - 8
 			"	out %[port], %[low]	\n\t"	// 1 - 8
 
 		// Phase B, entered for a 0 bit. 
 
-			"       rjmp bit_is_0		\n\t"	// 2 - 10
+			"       rjmp bit_is_0%=		\n\t"	// 2 - 10
 
 		// Phase B, entered for a1 bit.
 
-			" bit_is_1:			\n\t"
+			" bit_is_1%=:			\n\t"
 			"	nop			\n\t"   // 1 - 9
 			"	nop			\n\t"   // 1 - 10
 
 		// Phase B, entered for both 0 and 1 bit.
 
-			" bit_is_0:			\n\t"
-			"	nop			\n\t"   // 1 - 11
-			"	nop			\n\t"	// 1 - 12
-			"	nop			\n\t"	// 1 - 13
-			"	nop			\n\t"	// 1 - 14
-			"	nop			\n\t"	// 1 - 15
+			" bit_is_0%=:			\n\t"
+			"	.rept %[b_nops]		\n\t"	// 5 - 15
+			"	nop			\n\t"
+			"	.endr			\n\t"
 			"	out %[port], %[low]	\n\t" 	// 1 - 16
 
 
 		// Phase C. 
 
 			"	dec %[loopcounter]	\n\t"	// 1 - 17
-			"	breq new_byte		\n\t"	// False: 1 - 18, True: 2 - 19
+			"	breq new_byte%=		\n\t"	// False: 1 - 18, True: 2 - 19
 
 		// Still bits left to send in this byte - stay in inner loop
 
-			"	nop			\n\t"	// 1 - 19
-			"	nop			\n\t"	// 1 - 20
-			"	nop			\n\t"	// 1 - 21
-			"	nop			\n\t"	// 1 - 22
-			"	rjmp loop		\n\t"	// 2 - 24
+			"	.rept %[c_nops]		\n\t"	// 4 - 22
+			"	nop			\n\t"
+			"	.endr			\n\t"
+			"	rjmp loop%=		\n\t"	// 2 - 24
 
 		// New byte needed. Fall out of inner loop
 
-			" new_byte:			\n\t"
+			" new_byte%=:			\n\t"
 			
 			: [loopcounter] "=&d" (i) 			
-			: [data] "r" (current_byte), [port] "I" (_SFR_IO_ADDR(PORTB)), [high] "r" (high_value), [low] "r" (low_value)
+			: [data] "r" (current_byte), [port] "I" (_SFR_IO_ADDR(PORTB)), [high] "r" (high_value), [low] "r" (low_value),
+			  [a_nops] "n" (PHASE_A_NOPS), [b_nops] "n" (PHASE_B_NOPS), [c_nops] "n" (PHASE_C_NOPS)
 		);
     
 	}
 
+}
+
+/************************************************************
+ * output_begin: get the data pin ready and stop interrupts
+ * output_end: let interrupts in again
+ *	Params:
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static inline void output_begin(uint8_t data_pin)
+{
+
+	// Set data pin low
+	DDRB |= (1 << data_pin);
+	PORTB &= ~(1 << data_pin);
+
+	cli();
+
+}
+
+static inline void output_end(void)
+{
+
+	sei();
+
+}
+
+#elif WS2812_OUTPUT == WS2812_OUTPUT_TIMER1
+
+/********************************************************************************
+ * Timer1 output
+ *
+ * Timer1 runs from the 64MHz PLL in PWM mode, with OCR1C as TOP so that one
+ * timer period is one LED bit (80 counts for the 800kHz timings, 160 for
+ * WS2811). The LEDs are on PB0, which is /OC1A: it goes high when the timer
+ * reaches OCR1A and low again at BOTTOM, so the high time of a bit is the
+ * part of the period after OCR1A:
+ *
+ *	      OCR1A        TOP
+ *	+-------+-----------+
+ *	        |           |
+ *	        +-----------+
+ *
+ * OCR1A is buffered and only taken over when the timer passes TOP, so the
+ * CPU has a whole period to write the value for the next bit after the
+ * overflow flag says the last one was taken. An OCR1A above TOP never
+ * matches and keeps the line low, which fills the gaps between pixels.
+ *
+ * The pulse widths come from the 64MHz timer clock (15.6ns steps), not from
+ * instruction counts, so they are the same at any F_CPU. Run from the PLL
+ * (CKSEL 0001, see FUSES_PLL in the Makefile) the ATtiny85 needs no crystal
+ * at all. F_CPU is then 16MHz, and a bit takes 20 cycles. send_data uses
+ * about 9 of them per bit and 8 more per byte, so about 10 cycles per bit
+ * are left (30 for WS2811). They are spent waiting: interrupts stay off
+ * while a frame goes out, as an interrupt longer than a period would repeat
+ * a bit.
+ *
+ * OC1A itself is PB1, which stays an input for the button, so the timer does
+ * not drive it. The PLL takes about 100us to lock. It is started once and
+ * left running.
+ ********************************************************************************/
+
+#if WS2812_TIMING == WS2812_TIMING_WS2811
+#define TIMER1_TOP		159
+#else
+#define TIMER1_TOP		79
+#endif
+
+#define TIMER1_COUNTS(ns)	(((ns) * 64UL + 500) / 1000)
+#define TIMER1_IDLE			0xff		// Above TOP: the line stays low
+#define TIMER1_BIT_0		(TIMER1_TOP + 1 - TIMER1_COUNTS(T0H))
+#define TIMER1_BIT_1		(TIMER1_TOP + 1 - TIMER1_COUNTS(T1H))
+
+#define TIMER1_PWM			((1 << CTC1) | (1 << PWM1A) | (1 << CS10))	// PCK / 1
+
+/************************************************************
+ * next_period: wait until OCR1A has been taken over
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static inline void next_period(void)
+{
+
+	while (!(TIFR & (1 << TOV1)));
+	TIFR = (1 << TOV1);
+
+}
+
+static void send_data(uint8_t *framebuffer, uint16_t data_length, uint8_t data_pin)
+{
+
+	uint8_t current_byte;
+	uint8_t i;
+	uint8_t dim = ws2812_dim;
+
+	(void) data_pin;
+
+	while (data_length--) {
+
+		current_byte = *framebuffer++ >> dim;
+
+		for (i = 0; i < 8; i++) {
+			next_period();
+			OCR1A = (current_byte & 0x80) ? TIMER1_BIT_1 : TIMER1_BIT_0;
+			current_byte <<= 1;
+		}
+
+	}
+
+	// Low after the last bit
+	next_period();
+	OCR1A = TIMER1_IDLE;
+
+}
+
+static inline void output_begin(uint8_t data_pin)
+{
+
+	(void) data_pin;
+
+	DDRB |= (1 << PB0);
+	PORTB &= ~(1 << PB0);
+
+	if (!(PLLCSR & (1 << PCKE))) {
+		PLLCSR = (1 << PLLE);
+		_delay_us(100);		// The datasheet: PLOCK is not valid for 100us after PLLE
+		while (!(PLLCSR & (1 << PLOCK)));
+		PLLCSR |= (1 << PCKE);
+	}
+
+	cli();
+
+	// One period with the pin still on PORTB, so that OCR1A holds TIMER1_IDLE
+	// when the timer takes the pin over
+	OCR1C = TIMER1_TOP;
+	OCR1A = TIMER1_IDLE;
+	TCNT1 = 0;
+	TIFR = (1 << TOV1);
+	TCCR1 = TIMER1_PWM;
+	next_period();
+	TCCR1 = TIMER1_PWM | (1 << COM1A0);
+
+}
+
+static inline void output_end(void)
+{
+
+	// Let the last bit finish, then give the pin back to PORTB
+	next_period();
+	TCCR1 = 0;
+
 	sei();
 
 }
 
+#else
+#error "Unknown WS2812_OUTPUT"
+#endif
+
+/********************************************************************************
+ * Calibration
+ *
+ * Every pixel is scaled per channel by the white balance, and by the gain of
+ * its LED, just before it goes out, so the frame buffer is never touched.
+ * Only the balance is kept in RAM: the gain of an LED is read from EEPROM as
+ * the pixel is sent, which takes a few cycles. A gain of 0xff is skipped, so
+ * an uncalibrated channel costs nothing but the test.
+ *
+ * The EEPROM contents below go into main.eep, see "make eeprom".
+ ********************************************************************************/
+
+#if WS2812_CALIBRATE
+
+struct ws2812_calibration ws2812_calibration_eeprom EEMEM = {
+	.balance = {
+		.red = 0xff,
+		.green = 0xff,
+		.blue = 0xff,
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+		.white = 0xff,
+#endif
+	},
+#if WS2812_CALIBRATE_LEDS
+	.led_gain = { [0 ... WS2812_CALIBRATE_LEDS - 1] = 0xff },
+#endif
+};
+
+static struct RGB balance = {
+	.red = WS2812_BALANCE_RED,
+	.green = WS2812_BALANCE_GREEN,
+	.blue = WS2812_BALANCE_BLUE,
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	.white = WS2812_BALANCE_WHITE,
+#endif
+};
+
+/************************************************************
+ * balance_channel: one channel of the white balance
+ *	Params:
+ *		uint8_t *		channel in EEPROM
+ *		uint8_t			default
+ *	Returns:
+ *		uint8_t			gain
+ ************************************************************/
+
+static uint8_t balance_channel(uint8_t *channel, uint8_t fallback)
+{
+
+	uint8_t gain = eeprom_read_byte(channel);
+
+	return (gain == 0xff) ? fallback : gain;
+
+}
+
+extern void ws2812_calibration_load(void)
+{
+
+	balance.red = balance_channel(&ws2812_calibration_eeprom.balance.red, WS2812_BALANCE_RED);
+	balance.green = balance_channel(&ws2812_calibration_eeprom.balance.green, WS2812_BALANCE_GREEN);
+	balance.blue = balance_channel(&ws2812_calibration_eeprom.balance.blue, WS2812_BALANCE_BLUE);
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	balance.white = balance_channel(&ws2812_calibration_eeprom.balance.white, WS2812_BALANCE_WHITE);
+#endif
+
+}
+
+static inline uint8_t calibrate_channel(uint8_t value, uint8_t gain)
+{
+
+	return (gain == 0xff) ? value : scale8(value, gain);
+
+}
+
+/************************************************************
+ * calibrate: apply the calibration to a pixel
+ *	Params:
+ *		struct RGB *	colour (in place)
+ *		uint8_t			LED
+ *	Returns:
+ *		void
+ ************************************************************/
+
+static inline void calibrate(struct RGB *pixel, uint8_t led)
+{
+
+	struct RGB gain = balance;
+
+#if WS2812_CALIBRATE_LEDS
+	if (led < WS2812_CALIBRATE_LEDS) {
+
+		uint8_t led_gain = eeprom_read_byte(&ws2812_calibration_eeprom.led_gain[led]);
+
+		if (led_gain != 0xff) {
+			gain.red = scale8(gain.red, led_gain);
+			gain.green = scale8(gain.green, led_gain);
+			gain.blue = scale8(gain.blue, led_gain);
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+			gain.white = scale8(gain.white, led_gain);
+#endif
+		}
+
+	}
+#else
+	(void) led;
+#endif
+
+	pixel->red = calibrate_channel(pixel->red, gain.red);
+	pixel->green = calibrate_channel(pixel->green, gain.green);
+	pixel->blue = calibrate_channel(pixel->blue, gain.blue);
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	pixel->white = calibrate_channel(pixel->white, gain.white);
+#endif
+
+}
+
+#else
+
+extern void ws2812_calibration_load(void)
+{
+
+}
+
+#endif
+
+/************************************************************
+ * send_pixel: sends out the data for one LED
+ *	Params:
+ *		struct RGB 		LED color
+ *		uint8_t			LED
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * Used by the frame functions that work out each pixel just
+ * before it is sent. Interrupts must already be disabled.
+ ************************************************************/
+
+static inline void send_pixel(struct RGB pixel, uint8_t led, uint8_t data_pin)
+{
+
+#if WS2812_CALIBRATE
+	calibrate(&pixel, led);
+#else
+	(void) led;
+#endif
+
+#if WS2812_ORDER == WS2812_ORDER_GRBW && WS2812_EXTRACT_WHITE
+	rgbw_extract_white(&pixel);
+#endif
+
+	send_data((uint8_t *) &pixel, WS2812_BYTES_PER_LED, data_pin);
+
+}
+
 /************************************************************
  * send_frame: sends a frame of data out
  *	Params:
@@ -149,17 +493,164 @@ static void send_data(uint8_t *framebuffer, uint16_t data_length, uint8_t data_p
  * WSB2812 protocol (GRB, MSB first). The GRB part is taken
  * care of by the definition of struct RGB, and the MSB first
  * is taken care of by the lsl shift in send_data
+ *
+ * With WS2812_CALIBRATE, or on RGBW strips with
+ * WS2812_EXTRACT_WHITE, each pixel is copied and converted
+ * just before it goes out. The gap this leaves between pixels
+ * is far shorter than the reset time.
  ************************************************************/
 
 
 extern void send_frame(struct RGB *led_data, uint8_t num_leds, uint8_t data_pin)
 {
 
-	// Set data pin low
-	DDRB |= (1 << data_pin);
-	PORTB &= ~(1 << data_pin);
+	output_begin(data_pin);
 
 	// Send out data
-	send_data((uint8_t *)led_data, num_leds * 3, data_pin);
+#if WS2812_CALIBRATE || (WS2812_ORDER == WS2812_ORDER_GRBW && WS2812_EXTRACT_WHITE)
+	uint8_t led;
+
+	for (led = 0; led < num_leds; led++) {
+		send_pixel(led_data[led], led, data_pin);
+	}
+#else
+	send_data((uint8_t *)led_data, num_leds * WS2812_BYTES_PER_LED, data_pin);
+#endif
+
+	output_end();
+
+}
+
+/************************************************************
+ * send_frame_indexed: sends a palette indexed frame out
+ *	Params:
+ *		uint8_t *		LED palette indices
+ *		struct RGB *	palette
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * Each index is looked up in the palette between two pixels,
+ * so the frame never exists as RGB data in memory. The lookup
+ * takes a couple of dozen cycles, well within the low time
+ * the LEDs tolerate before they latch.
+ ************************************************************/
+
+extern void send_frame_indexed(uint8_t *indices, struct RGB *palette, uint8_t num_leds, uint8_t data_pin)
+{
+
+	uint8_t led;
+	uint8_t index;
+
+	output_begin(data_pin);
+
+	for (led = 0; led < num_leds; led++) {
+
+#if WS2812_PALETTE_BITS == 4
+		index = indices[led >> 1];
+		if (led & 1) {
+			index >>= 4;
+		}
+		index &= 0x0f;
+#else
+		index = indices[led];
+#endif
+
+		send_pixel(palette[index], led, data_pin);
+
+	}
+
+	output_end();
+
+}
+
+/************************************************************
+ * send_frame_mapped: sends a frame built from a few colours
+ *	Params:
+ *		const uint8_t *	colour of each LED (in PROGMEM)
+ *		struct RGB *	colours
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ ************************************************************/
+
+extern void send_frame_mapped(const uint8_t *map, struct RGB *colours, uint8_t num_leds, uint8_t data_pin)
+{
+
+	uint8_t led;
+
+	output_begin(data_pin);
+
+	for (led = 0; led < num_leds; led++) {
+		send_pixel(colours[pgm_read_byte(&map[led])], led, data_pin);
+	}
+
+	output_end();
+
+}
+
+/************************************************************
+ * send_frame_shader: sends a frame worked out pixel by pixel
+ *	Params:
+ *		shader function	returns the colour of an LED
+ *		void *			shader parameter
+ *		uint16_t		frame time
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * The line sits low while the shader runs. The LEDs only
+ * latch after WS2812_RESET_US of that, so as long as every
+ * call stays within WS2812_SHADER_BUDGET_CYCLES the frame goes
+ * out as one.
+ *
+ * Build with -DWS2812_SHADER_PROFILE to measure this on the
+ * target: Timer1 then runs at CK/8, the longest call is kept
+ * in ws2812_shader_max_cycles and the calls over budget are
+ * counted in ws2812_shader_over. Timer1 wraps after 2048
+ * cycles, which is well above any budget.
+ ************************************************************/
+
+#ifdef WS2812_SHADER_PROFILE
+volatile uint16_t ws2812_shader_max_cycles = 0;
+volatile uint16_t ws2812_shader_over = 0;
+#endif
+
+extern void send_frame_shader(struct RGB (*shader)(uint8_t, uint16_t, void *), void *parameter, uint16_t time, uint8_t num_leds, uint8_t data_pin)
+{
+
+	uint8_t led;
+	struct RGB pixel;
+
+#ifdef WS2812_SHADER_PROFILE
+	TCCR1 = (1 << CS12);	// CK/8
+#endif
+
+	output_begin(data_pin);
+
+	for (led = 0; led < num_leds; led++) {
+
+#ifdef WS2812_SHADER_PROFILE
+		uint8_t start = TCNT1;
+		pixel = shader(led, time, parameter);
+		uint16_t cycles = (uint8_t) (TCNT1 - start) * 8;
+		if (cycles > ws2812_shader_max_cycles) {
+			ws2812_shader_max_cycles = cycles;
+		}
+		if (cycles > WS2812_SHADER_BUDGET_CYCLES) {
+			ws2812_shader_over++;
+		}
+#else
+		pixel = shader(led, time, parameter);
+#endif
+
+		send_pixel(pixel, led, data_pin);
+
+	}
+
+	output_end();
 
 }
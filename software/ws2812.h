@@ -4,18 +4,239 @@
  * WS2812 LED driver library
  ************************************************/
 
+#ifndef WS2812_H
+#define WS2812_H
+
+#include <stdint.h>
+
+/************************************************************
+ * Build time configuration
+ *
+ * Pixel format (channel order on the wire) and bit timing are
+ * selected at compile time, e.g. from the Makefile with
+ * -DWS2812_ORDER=WS2812_ORDER_GRBW -DWS2812_TIMING=WS2812_TIMING_SK6812
+ * so the output loop is specialised for one strip type and
+ * never has to branch on it at runtime.
+ ************************************************************/
+
+/* Channel orders */
+#define WS2812_ORDER_GRB	0	// WS2812(B), SK6812 RGB
+#define WS2812_ORDER_RGB	1	// WS2811 based strips, most of them
+#define WS2812_ORDER_BRG	2	// Some WS2811 pixel strings
+#define WS2812_ORDER_GRBW	3	// SK6812 RGBW
+
+/* Bit timings */
+#define WS2812_TIMING_WS2812	0	// 800kHz, T0H 400ns, T1H 800ns
+#define WS2812_TIMING_SK6812	1	// 800kHz, T0H 300ns, T1H 600ns
+#define WS2812_TIMING_WS2811	2	// 400kHz (low speed mode), T0H 500ns, T1H 1200ns
+
+#ifndef WS2812_ORDER
+#define WS2812_ORDER	WS2812_ORDER_GRB
+#endif
+
+#ifndef WS2812_TIMING
+#define WS2812_TIMING	WS2812_TIMING_WS2812
+#endif
+
+/* Output backends */
+#define WS2812_OUTPUT_BITBANG	0	// Counted cycles on any PORTB pin, interrupts off
+#define WS2812_OUTPUT_TIMER1	1	// ATtiny85 Timer1 from the 64MHz PLL, PB0 only, interrupts off
+
+#ifndef WS2812_OUTPUT
+#define WS2812_OUTPUT	WS2812_OUTPUT_BITBANG
+#endif
+
+/* Timer1 output uses Timer1 and the PLL all to itself, so it
+ * cannot be combined with the profile builds that time code
+ * with Timer1 */
+#if WS2812_OUTPUT == WS2812_OUTPUT_TIMER1 && (defined(WS2812_SHADER_PROFILE) || defined(AUDIO_PROFILE) || defined(COLOUR_PROFILE) || defined(ANIMATION_PROFILE))
+#error "WS2812_OUTPUT_TIMER1 needs Timer1, which the profile builds use too"
+#endif
+
+/* RGBW only: move the common part of R, G and B to the white
+ * LED while sending, so patterns written for RGB still work */
+#ifndef WS2812_EXTRACT_WHITE
+#define WS2812_EXTRACT_WHITE	1
+#endif
+
+/* Calibration while sending: a gain per channel for the white
+ * balance of the whole string, and optionally a gain per LED.
+ * Both come from EEPROM (see struct ws2812_calibration), so
+ * patterns can use ideal colours. WS2812_CALIBRATE_LEDS is the
+ * number of LEDs with their own gain, 0 for none. */
+#ifndef WS2812_CALIBRATE
+#define WS2812_CALIBRATE		1
+#endif
+
+#ifndef WS2812_CALIBRATE_LEDS
+#define WS2812_CALIBRATE_LEDS	0
+#endif
+
+/* White balance used where the EEPROM holds 0xff, so also on a
+ * snowflake that was never calibrated. Green looks brightest */
+#ifndef WS2812_BALANCE_RED
+#define WS2812_BALANCE_RED		0xff
+#endif
+
+#ifndef WS2812_BALANCE_GREEN
+#define WS2812_BALANCE_GREEN	0xc0
+#endif
+
+#ifndef WS2812_BALANCE_BLUE
+#define WS2812_BALANCE_BLUE		0xff
+#endif
+
+#ifndef WS2812_BALANCE_WHITE
+#define WS2812_BALANCE_WHITE	0xff
+#endif
+
+/* Palette indexed frames: bits per LED index, 4 (two LEDs per
+ * byte) or 8 */
+#ifndef WS2812_PALETTE_BITS
+#define WS2812_PALETTE_BITS	4
+#endif
+
+#if WS2812_PALETTE_BITS != 4 && WS2812_PALETTE_BITS != 8
+#error "WS2812_PALETTE_BITS must be 4 or 8"
+#endif
+
+/* Shader frames: the line may stay low for at most the reset
+ * time between two pixels before the LEDs latch. A shader gets
+ * half of that, the rest is margin for the loop and for parts
+ * that latch early. */
+#if WS2812_TIMING == WS2812_TIMING_SK6812
+#define WS2812_RESET_US		80
+#else
+#define WS2812_RESET_US		50
+#endif
+
+/* Cycles the calibration of a pixel takes between two pixels,
+ * out of the same low time */
+#if !WS2812_CALIBRATE
+#define WS2812_CALIBRATE_CYCLES		0
+#elif WS2812_CALIBRATE_LEDS
+#define WS2812_CALIBRATE_CYCLES		260
+#else
+#define WS2812_CALIBRATE_CYCLES		140
+#endif
+
+#define WS2812_SHADER_BUDGET_CYCLES	((WS2812_RESET_US / 2) * (F_CPU / 1000000UL) - WS2812_CALIBRATE_CYCLES)
+
 /* Public interface */
 
 /************************************************************
 * struct RGB: color data for 1 LED. 8-bit color
+*
+* The members are laid out in the order they go out on the
+* wire, so a frame can be sent straight from memory. Always
+* use the member names (or designated initialisers) to set
+* colours: the order changes with WS2812_ORDER.
 *************************************************************/
 
 struct RGB {
+#if WS2812_ORDER == WS2812_ORDER_GRB || WS2812_ORDER == WS2812_ORDER_GRBW
 	uint8_t green;
 	uint8_t red;
 	uint8_t blue;
+#elif WS2812_ORDER == WS2812_ORDER_RGB
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+#elif WS2812_ORDER == WS2812_ORDER_BRG
+	uint8_t blue;
+	uint8_t red;
+	uint8_t green;
+#else
+#error "Unknown WS2812_ORDER"
+#endif
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+	uint8_t white;
+#endif
 };
 
+#define WS2812_BYTES_PER_LED	(sizeof(struct RGB))
+
+/************************************************************
+ * rgbw_extract_white: move the white component of a colour
+ * to the white channel
+ *	Params:
+ *		struct RGB *	colour to convert (in place)
+ *	Returns:
+ *		void
+ *
+ * The smallest of R, G and B is what all three have in
+ * common, so that is lit on the white LED instead. The
+ * result is saturated at 255. On RGB strips this does
+ * nothing.
+ ************************************************************/
+
+static inline void rgbw_extract_white(struct RGB *colour)
+{
+#if WS2812_ORDER == WS2812_ORDER_GRBW
+
+	uint8_t white = colour->red;
+
+	if (colour->green < white) {white = colour->green;}
+	if (colour->blue < white) {white = colour->blue;}
+
+	colour->red -= white;
+	colour->green -= white;
+	colour->blue -= white;
+
+	if (colour->white > (uint8_t) ~white) {
+		colour->white = 0xff;
+	} else {
+		colour->white += white;
+	}
+
+#else
+	(void) colour;
+#endif
+}
+
+/************************************************************
+ * struct ws2812_calibration: calibration data in EEPROM
+ *
+ * Gains are in 256ths, 0xff leaves a channel as it is. A 0xff
+ * in balance stands for the WS2812_BALANCE_* default instead,
+ * so an erased EEPROM gives the default white balance. The
+ * values are read while sending, and only balance is kept in
+ * RAM, by ws2812_calibration_load.
+ ************************************************************/
+
+struct ws2812_calibration {
+	struct RGB balance;							// Gain per channel, whole string
+#if WS2812_CALIBRATE_LEDS
+	uint8_t led_gain[WS2812_CALIBRATE_LEDS];	// Gain per LED, all channels
+#endif
+};
+
+#if WS2812_CALIBRATE
+extern struct ws2812_calibration ws2812_calibration_eeprom;
+#endif
+
+/************************************************************
+ * ws2812_calibration_load: read the white balance from EEPROM
+ *	Params:
+ *		none
+ *	Returns:
+ *		void
+ *
+ * Call once at start up, and again after changing the EEPROM.
+ ************************************************************/
+
+extern void ws2812_calibration_load(void);
+
+/************************************************************
+ * ws2812_dim: global brightness
+ *
+ * Every byte is shifted right by this many bits on its way
+ * out, so each step halves the brightness of all frames
+ * without touching the frame data. 0 is full brightness.
+ ************************************************************/
+
+extern uint8_t ws2812_dim;
+
 /************************************************************
  * send_frame: sends a frame of data out
  *	Params:
@@ -27,3 +248,65 @@ struct RGB {
  ************************************************************/
 
 extern void send_frame(struct RGB *, uint8_t, uint8_t);
+
+/************************************************************
+ * send_frame_indexed: sends a palette indexed frame out
+ *	Params:
+ *		uint8_t *		LED palette indices
+ *		struct RGB *	palette
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * With 4-bit indices, LED 2n is in the low nibble of byte n
+ * and LED 2n+1 in the high nibble.
+ ************************************************************/
+
+extern void send_frame_indexed(uint8_t *, struct RGB *, uint8_t, uint8_t);
+
+/************************************************************
+ * send_frame_mapped: sends a frame built from a few colours
+ *	Params:
+ *		const uint8_t *	colour of each LED (in PROGMEM)
+ *		struct RGB *	colours
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * Like send_frame_indexed, but with a fixed 8-bit map in flash,
+ * so that only the colours take up RAM.
+ ************************************************************/
+
+extern void send_frame_mapped(const uint8_t *, struct RGB *, uint8_t, uint8_t);
+
+/************************************************************
+ * send_frame_shader: sends a frame worked out pixel by pixel
+ *	Params:
+ *		shader function	returns the colour of an LED
+ *			uint8_t		LED index
+ *			uint16_t	frame time
+ *			void *		shader parameter
+ *		void *			shader parameter
+ *		uint16_t		frame time
+ *		uint8_t 		number of LEDs
+ *		uint8_t			data pin
+ *	Returns:
+ *		void
+ *
+ * The shader is called just before each pixel is sent, with
+ * interrupts disabled, so no frame buffer is needed at all. It
+ * must return within WS2812_SHADER_BUDGET_CYCLES.
+ ************************************************************/
+
+extern void send_frame_shader(struct RGB (*)(uint8_t, uint16_t, void *), void *, uint16_t, uint8_t, uint8_t);
+
+#ifdef WS2812_SHADER_PROFILE
+/* Longest shader call seen so far, in cycles (8 cycle steps),
+ * and the number of calls over WS2812_SHADER_BUDGET_CYCLES */
+extern volatile uint16_t ws2812_shader_max_cycles;
+extern volatile uint16_t ws2812_shader_over;
+#endif
+
+#endif